@@ -2,8 +2,34 @@
 // https://github.com/Gumix/my-first-raycaster
 //
 
+#include <limits>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <sstream>
+#include <type_traits>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <SDL.h>
 
 using std::rand;
@@ -21,6 +47,30 @@ double Map(double x, double in_min, double in_max,
 	return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
 
+// Heap bytes held by a vector, by capacity
+template <typename T>
+size_t VectorBytes(const std::vector<T> &v)
+{
+	return v.capacity() * sizeof(T);
+}
+
+// Position on the Z-order curve: the bits of two 16-bit coordinates
+// interleaved, x in the even bits
+uint32_t Morton(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v)
+	{
+		v &= 0xffff;
+		v = (v | v << 8) & 0x00ff00ff;
+		v = (v | v << 4) & 0x0f0f0f0f;
+		v = (v | v << 2) & 0x33333333;
+		v = (v | v << 1) & 0x55555555;
+		return v;
+	};
+
+	return spread(x) | spread(y) << 1;
+}
+
 class Angle
 {
 	double rad;
@@ -92,6 +142,12 @@ public:
 		w = std::min(int(wd + 0.5), 255);
 		return Color(w, w, w);
 	}
+
+	// Framebuffer pixel, ARGB8888
+	uint32_t Pack() const
+	{
+		return 0xff000000u | r << 16 | g << 8 | b;
+	}
 };
 
 class Vector2
@@ -114,15 +170,44 @@ public:
 	Vector2 operator + (const Vector2 v) const { return Vector2(x + v.x, y + v.y); }
 	Vector2 operator - (const Vector2 v) const { return Vector2(x - v.x, y - v.y); }
 	double operator * (const Vector2 v) const { return x * v.x + y * v.y; }
+	Vector2 operator * (double k) const { return Vector2(x * k, y * k); }
 	Vector2 operator / (double k) const { return Vector2(x / k, y / k); }
 	Vector2 & operator /= (double k) { x /= k; y /= k; return *this; }
 };
 
+// Distance from point p to segment ab
+double SegmentDistance(Vector2 p, Vector2 a, Vector2 b)
+{
+	Vector2 ab = b - a;
+	double len2 = ab * ab;
+	double t = len2 > 0.0 ? std::min(std::max((p - a) * ab / len2, 0.0), 1.0) : 0.0;
+	return (p - (a + ab * t)).Length();
+}
+
+// Distance between segments ab and cd, zero if they cross
+double SegmentDistance(Vector2 a, Vector2 b, Vector2 c, Vector2 d)
+{
+	auto side = [](Vector2 o, Vector2 p, Vector2 q)
+	{
+		return (p.x - o.x) * (q.y - o.y) - (p.y - o.y) * (q.x - o.x);
+	};
+
+	double s1 = side(a, b, c), s2 = side(a, b, d);
+	double s3 = side(c, d, a), s4 = side(c, d, b);
+	if (((s1 < 0.0) != (s2 < 0.0)) && ((s3 < 0.0) != (s4 < 0.0)))
+		return 0.0;
+
+	return std::min(std::min(SegmentDistance(a, c, d), SegmentDistance(b, c, d)),
+					std::min(SegmentDistance(c, a, b), SegmentDistance(d, a, b)));
+}
+
 class SDL_Screen
 {
 	int width, height;
 	SDL_Window *window = nullptr;
 	SDL_Renderer *renderer = nullptr;
+	SDL_Texture *texture = nullptr;
+	std::vector<uint32_t> pixels;
 
 	void SetDrawColor(const Color &c) const
 	{
@@ -155,11 +240,23 @@ public:
 		if (SDL_RenderSetLogicalSize(renderer, width, height))
 			Error("SDL_RenderSetLogicalSize failed");
 
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+									SDL_TEXTUREACCESS_STREAMING, width, height);
+		if (!texture)
+			Error("SDL_CreateTexture failed");
+		pixels.assign(width * height, Color::Black().Pack());
+
 		Clear();
 	};
 
 	~SDL_Screen()
 	{
+		if (texture)
+		{
+			SDL_DestroyTexture(texture);
+			texture = nullptr;
+		}
+
 		if (renderer)
 		{
 			SDL_DestroyRenderer(renderer);
@@ -178,6 +275,12 @@ public:
 	int GetWidth() const { return width; }
 	int GetHeight() const { return height; }
 
+	// Software framebuffer and the streaming texture it goes to
+	size_t Bytes() const
+	{
+		return VectorBytes(pixels) + size_t(width) * height * sizeof(uint32_t);
+	}
+
 	void Clear() const
 	{
 		SetDrawColor(Color::Black());
@@ -191,6 +294,23 @@ public:
 		SDL_RenderPresent(renderer);
 	}
 
+	// Software framebuffer, one row of GetWidth() pixels after another.
+	// Disjoint rectangles may be written from different threads.
+	uint32_t *Pixels() { return pixels.data(); }
+
+	// Copy a rectangle of the framebuffer to the screen
+	void Upload(int x, int y, int w, int h) const
+	{
+		SDL_Rect rect = { x, y, w, h };
+
+		if (SDL_UpdateTexture(texture, &rect, pixels.data() + y * width + x,
+							  width * sizeof(uint32_t)))
+			Error("SDL_UpdateTexture failed");
+
+		if (SDL_RenderCopy(renderer, texture, &rect, &rect))
+			Error("SDL_RenderCopy failed");
+	}
+
 	void Pixel(int x, int y, const Color &c = Color::White()) const
 	{
 		SetDrawColor(c);
@@ -230,282 +350,4509 @@ public:
 
 static SDL_Screen Screen;
 
-class Wall
+// Software drawing into one rectangle of the framebuffer, everything
+// outside of it is clipped. Canvases over disjoint rectangles can be
+// drawn from different threads.
+class Canvas
 {
-public:
-	int x1, y1, x2, y2;
+	uint32_t *fb;
+	int pitch;
+	int x1, y1, x2, y2;	// clip rectangle, right and bottom exclusive
 
-	Wall(int x1, int y1, int x2, int y2)
-		: x1(x1), y1(y1), x2(x2), y2(y2)
+public:
+	Canvas(int x, int y, int w, int h)
+		: fb(Screen.Pixels()), pitch(Screen.GetWidth()),
+		  x1(std::max(x, 0)), y1(std::max(y, 0)),
+		  x2(std::min(x + w, Screen.GetWidth())),
+		  y2(std::min(y + h, Screen.GetHeight()))
 	{
 	};
 
-	void Draw(double x_offset, double y_offset, double scale,
-			  const Color &c = Color::White()) const
+	void RectFill(int x, int y, int w, int h, const Color &c = Color::White()) const
 	{
-		int x1s = round(x1 * scale + x_offset);
-		int y1s = round(y1 * scale + y_offset);
-		int x2s = round(x2 * scale + x_offset);
-		int y2s = round(y2 * scale + y_offset);
+		int rx1 = std::max(x, x1), rx2 = std::min(x + w, x2);
+		int ry1 = std::max(y, y1), ry2 = std::min(y + h, y2);
+		uint32_t v = c.Pack();
 
-		Screen.Line(x1s, y1s, x2s, y2s, c);
-	};
+		for (int j = ry1; j < ry2; j++)
+			std::fill(fb + j * pitch + rx1, fb + j * pitch + std::max(rx1, rx2), v);
+	}
+
+	void Rect(int x, int y, int w, int h, const Color &c = Color::White()) const
+	{
+		RectFill(x, y, w, 1, c);
+		RectFill(x, y + h - 1, w, 1, c);
+		RectFill(x, y, 1, h, c);
+		RectFill(x + w - 1, y, 1, h, c);
+	}
+
+	// Clipped to the rectangle first (Liang-Barsky), then Bresenham
+	void Line(int ax, int ay, int bx, int by, const Color &c = Color::White()) const
+	{
+		double dx = bx - ax, dy = by - ay;
+		double p[4] = { -dx, dx, -dy, dy };
+		double q[4] = { double(ax - x1), double(x2 - 1 - ax),
+						double(ay - y1), double(y2 - 1 - ay) };
+		double t0 = 0.0, t1 = 1.0;
+
+		for (int k = 0; k < 4; k++)
+		{
+			if (p[k] == 0.0)
+			{
+				if (q[k] < 0.0)
+					return;
+				continue;
+			}
+
+			double t = q[k] / p[k];
+			if (p[k] < 0.0)
+				t0 = std::max(t0, t);
+			else
+				t1 = std::min(t1, t);
+		}
+
+		if (t0 > t1)
+			return;
+
+		int x = round(ax + t0 * dx), y = round(ay + t0 * dy);
+		int ex = round(ax + t1 * dx), ey = round(ay + t1 * dy);
+		int sx = x < ex ? 1 : -1, sy = y < ey ? 1 : -1;
+		int adx = abs(ex - x), ady = -abs(ey - y);
+		int err = adx + ady;
+		uint32_t v = c.Pack();
+
+		for (;;)
+		{
+			if (x >= x1 && x < x2 && y >= y1 && y < y2)
+				fb[y * pitch + x] = v;
+			if (x == ex && y == ey)
+				break;
+
+			int e2 = 2 * err;
+			if (e2 >= ady)
+			{
+				err += ady;
+				x += sx;
+			}
+			if (e2 <= adx)
+			{
+				err += adx;
+				y += sy;
+			}
+		}
+	}
 };
 
-class Ray
+// Fixed set of threads running index-addressed tasks. The calling thread
+// works too, so worker 0 is always the caller. Run() is not reentrant.
+class WorkerPool
 {
-	double x, y;
-	Angle angle;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
 
-public:
-	Ray(double x, double y, Angle a): x(x), y(y), angle(a)
-	{
-	};
+	void (*job)(void *, int, int) = nullptr;
+	void *ctx = nullptr;
+	int num_tasks = 0;
+	std::atomic<int> next_task;
+	int busy = 0;
+	int active;	// workers that take tasks, see SetActive
+	unsigned generation = 0;
+	bool quit = false;
 
-	Angle GetAngle() const
+	void Work(int worker)
 	{
-		return angle;
+		int task;
+		while ((task = next_task++) < num_tasks)
+			job(ctx, task, worker);
 	}
 
-	void Rotate(double da)
+	void Loop(int worker)
 	{
-		angle += da;
+		unsigned seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+
+		for (;;)
+		{
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+			bool join = worker < active;
+
+			lock.unlock();
+			if (join)
+				Work(worker);
+			lock.lock();
+
+			if (--busy == 0)
+				done.notify_one();
+		}
 	}
 
-	void MoveTo(double new_x, double new_y)
+public:
+	explicit WorkerPool(int num_workers): active(num_workers)
 	{
-		x = new_x;
-		y = new_y;
+		for (int i = 1; i < num_workers; i++)
+			threads.push_back(std::thread(&WorkerPool::Loop, this, i));
 	}
 
-	bool Intersect(const Wall &wall, double &tw, double &tr) const
+	~WorkerPool()
 	{
-		Vector2 dir(angle);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
 
-		double nwx = wall.y2 - wall.y1;
-		double nwy = wall.x1 - wall.x2;
-		double nrx = dir.y;
-		double nry = -dir.x;
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+	}
 
-		double den = nry * nwx - nrx * nwy;
+	int Size() const { return threads.size() + 1; }
+	int Active() const { return active; }
 
-		if (den == 0.0)	// exact checking is ok here
-			return false;
+	// Only the first n workers, the calling thread included, take tasks;
+	// the others sit out the following runs
+	void SetActive(int n)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		active = std::min(std::max(n, 1), Size());
+	}
 
-		tw = -(nrx * (wall.x1 - x) + nry * (wall.y1 - y)) / den;
-		tr = -(nwy * (wall.y1 - y) + nwx * (wall.x1 - x)) / den;
+	// Call f(task, worker) for every task in [0, n) and wait for all of them
+	template <typename F>
+	void Run(int n, F &&f)
+	{
+		typedef typename std::remove_reference<F>::type Fn;
+		struct Thunk
+		{
+			static void Call(void *p, int task, int worker)
+			{
+				(*static_cast<Fn *>(p))(task, worker);
+			}
+		};
 
-		return tw > 0.0 && tw < 1.0 && tr > 0.0;
-	};
-};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = Thunk::Call;
+			ctx = &f;
+			num_tasks = n;
+			next_task = 0;
+			busy = threads.size();
+			generation++;
+		}
+		wake.notify_all();
 
-struct RayHit
-{
-	double dist, wall_x, wall_y;
+		Work(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busy == 0; });
+	}
 };
 
-class Player
+static WorkerPool Workers(std::max(1u, std::thread::hardware_concurrency()));
+
+// Worker processes forked from this one, for work that has to scale past
+// a single process. They inherit everything built before the fork and
+// exchange data with the parent through one block of shared memory; a
+// socket pair per worker only carries the start and done bytes. Workers
+// have no threads of their own, and like WorkerPool this is not reentrant.
+// They must never touch Workers: its threads stayed in the parent, and a
+// Run() in a worker waits for them forever. Use a local WorkerPool(1).
+class ProcessPool
 {
-	double x, y;
-	Angle heading;
-	std::vector<Ray> rays;
-	static constexpr int num_rays = 320;
-	static constexpr double view_angle = 60.0;
+	std::vector<pid_t> pids;
+	std::vector<int> sockets;
+	void *shared;
+	size_t shared_size;
+
+	static void Error(const char *msg)
+	{
+		std::cerr << "Error: " << msg << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
 
 public:
-	Player() = default;
+	explicit ProcessPool(size_t shared_bytes): shared_size(shared_bytes)
+	{
+		shared = mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (shared == MAP_FAILED)
+			Error("mmap failed");
+	}
 
-	Player(double x, double y): x(x), y(y)
+	// Fork n workers, worker k calls serve(k, n) on every Start
+	template <typename F>
+	void Fork(int n, F serve)
 	{
-		Angle a = heading - view_angle / 2.0;
-		for (int i = 0; i < num_rays; i++)
+		for (int k = 0; k < n; k++)
 		{
-			rays.push_back(Ray(x, y, a));
-			a += view_angle / num_rays;
-		}
-	};
-
-	double GetX() const { return x; }
-	double GetY() const { return y; }
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+				Error("socketpair failed");
 
-	bool CanMove(double dd, int map_width, int map_height) const
-	{
-		Vector2 dir(heading);
-		int new_x = round(x + dir.x * dd);
-		int new_y = round(y + dir.y * dd);
+			pid_t pid = fork();
+			if (pid < 0)
+				Error("fork failed");
 
-		if (new_x < 1 || new_y < 1)
-			return false;
+			if (pid == 0)
+			{
+				// Only our own socket, so the others see EOF when the parent goes
+				for (size_t i = 0; i < sockets.size(); i++)
+					close(sockets[i]);
+				close(sv[0]);
 
-		if (new_x >= map_width - 1 || new_y >= map_height - 1)
-			return false;
+				char c;
+				while (read(sv[1], &c, 1) == 1)
+				{
+					serve(k, n);
+					if (send(sv[1], &c, 1, MSG_NOSIGNAL) != 1)
+						break;
+				}
+				_exit(0);
+			}
 
-		return true;
+			close(sv[1]);
+			sockets.push_back(sv[0]);
+			pids.push_back(pid);
+		}
 	}
 
-	void Rotate(double da)
+	~ProcessPool()
 	{
-		heading += da;
-		for (size_t i = 0; i < rays.size(); i++)
-			rays[i].Rotate(da);
+		for (size_t i = 0; i < sockets.size(); i++)
+			close(sockets[i]);
+		for (size_t i = 0; i < pids.size(); i++)
+			waitpid(pids[i], nullptr, 0);
+		munmap(shared, shared_size);
 	}
 
-	void Move(double dd)
+	int Size() const { return pids.size(); }
+	void *Shared() const { return shared; }
+	size_t SharedBytes() const { return shared_size; }
+
+	// Let all workers go, the shared memory is theirs until Wait returns.
+	// A worker that died is an error, not a SIGPIPE.
+	void Start()
 	{
-		Vector2 dir(heading);
-		x += dir.x * dd;
-		y += dir.y * dd;
+		char c = 0;
+		for (size_t i = 0; i < sockets.size(); i++)
+			if (send(sockets[i], &c, 1, MSG_NOSIGNAL) != 1)
+				Error("worker process is gone");
+	}
 
-		for (size_t i = 0; i < rays.size(); i++)
-			rays[i].MoveTo(x, y);
+	void Wait()
+	{
+		char c;
+		for (size_t i = 0; i < sockets.size(); i++)
+			if (read(sockets[i], &c, 1) != 1)
+				Error("worker process is gone");
 	}
+};
 
-	std::vector<RayHit> CalcRayHits(const std::vector<Wall> &walls) const
+// Bump allocator for per-frame temporaries. Nothing is freed on its own,
+// everything goes at once on Reset(), and the blocks are kept for the
+// next frame, so once it has grown a frame does not call malloc at all.
+class Arena
+{
+	static const size_t block_size = 64 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::vector<size_t> sizes;
+	size_t current = 0;	// block being filled
+	size_t used = 0;	// bytes taken from it
+	size_t frame = 0;	// bytes handed out since the last Reset
+	size_t peak = 0;
+
+	void AddBlock(size_t size)
 	{
-		std::vector<RayHit> res;
+		blocks.emplace_back(new char[size]);
+		sizes.push_back(size);
+	}
 
-		for (size_t i = 0; i < rays.size(); i++)
+public:
+	void *Allocate(size_t n, size_t align)
+	{
+		for (;; current++, used = 0)
 		{
-			int j_hit;
-			double tw_hit, tr_hit = std::numeric_limits<double>::max();
+			if (current == blocks.size())
+				AddBlock(std::max(size_t(block_size), n + align));
 
-			for (size_t j = 0; j < walls.size(); j++)
+			uintptr_t base = reinterpret_cast<uintptr_t>(blocks[current].get());
+			size_t start = (base + used + align - 1) / align * align - base;
+			if (start + n <= sizes[current])
 			{
-				double tw, tr;
-				if (rays[i].Intersect(walls[j], tw, tr))
-					if (tr < tr_hit)
-					{
-						j_hit = j;
-						tr_hit = tr;
-						tw_hit = tw;
-					}
+				used = start + n;
+				frame += n;
+				peak = std::max(peak, frame);
+				return blocks[current].get() + start;
 			}
+		}
+	}
 
-			if (tr_hit != std::numeric_limits<double>::max())
-			{
-				const Wall w = walls[j_hit];
-				res.push_back({
-					.dist = tr_hit * Cos(rays[i].GetAngle() - heading),
-					.wall_x = Mix(w.x1, w.x2, tw_hit),
-					.wall_y = Mix(w.y1, w.y2, tw_hit)
-				});
-			}
+	// A frame that spilled over into more blocks leaves a single block
+	// big enough for all of them, so the next one fits in it
+	void Reset()
+	{
+		if (current > 0)
+		{
+			size_t total = 0;
+			for (size_t i = 0; i < sizes.size(); i++)
+				total += sizes[i];
+
+			blocks.clear();
+			sizes.clear();
+			AddBlock(total);
 		}
+		current = used = frame = 0;
+	}
 
-		return res;
-	};
+	// Most bytes handed out during a single frame
+	size_t Peak() const { return peak; }
+
+	size_t Bytes() const
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < sizes.size(); i++)
+			n += sizes[i];
+		return n + VectorBytes(blocks) + VectorBytes(sizes);
+	}
 };
 
-class View
+template <typename T>
+struct ArenaAllocator
 {
-protected:
-	int x, y;
-	int width, height;
+	typedef T value_type;
+	Arena *arena;
 
-public:
-	View() = default;
+	explicit ArenaAllocator(Arena &arena): arena(&arena) {}
 
-	View(int offset, int width, int height)
-		: x(offset), width(width), height(height)
-	{
-		y = (Screen.GetHeight() - height) / 2;
-	};
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U> &a): arena(a.arena) {}
 
-	void Draw() const
+	T *allocate(size_t n)
 	{
-		Screen.Rect(x, y, width, height, Color(0, 50, 100));
-	};
+		return static_cast<T *>(arena->Allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *, size_t) {}
 };
 
-class View2D: public View
+template <typename T, typename U>
+bool operator == (const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
 {
-	double scale;
+	return a.arena == b.arena;
+}
 
-public:
-	View2D() = default;
+template <typename T, typename U>
+bool operator != (const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+	return a.arena != b.arena;
+}
 
-	View2D(int offset, int width, int height, double scale)
-		: View(offset, width, height), scale(scale)
-	{
-	};
+// Vector living until the end of the frame
+template <typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T>>;
 
-	void Draw(double plr_x, double plr_y,
-			  const std::vector<Wall> &walls,
-			  const std::vector<RayHit> &ray_hits) const
-	{
-		for (size_t i = 0; i < ray_hits.size(); i++)
-		{
-			int x1 = round(plr_x * scale + x);
-			int y1 = round(plr_y * scale + y);
-			int x2 = round(ray_hits[i].wall_x * scale + x);
-			int y2 = round(ray_hits[i].wall_y * scale + y);
-			Screen.Line(x1, y1, x2, y2, Color::Gray(33));
-		}
+// One arena per worker of the pool, all reset when a frame starts
+static std::vector<Arena> FrameArenas(Workers.Size());
 
-		for (size_t i = 4; i < walls.size(); i++)
-			walls[i].Draw(x, y, scale);
+void ResetFrameArenas()
+{
+	for (size_t i = 0; i < FrameArenas.size(); i++)
+		FrameArenas[i].Reset();
+}
 
-		View::Draw();
-	};
-};
+void ReportFrameArenas()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < FrameArenas.size(); i++)
+		total += FrameArenas[i].Peak();
 
-class View3D: public View
+	std::cout << "Peak frame arena usage: " << total << " bytes";
+	for (size_t i = 0; i < FrameArenas.size(); i++)
+		std::cout << (i ? ", " : " (") << FrameArenas[i].Peak();
+	std::cout << " per worker)" << std::endl;
+}
+
+class Wall
 {
 public:
-	View3D() = default;
+	int x1, y1, x2, y2;
 
-	View3D(int offset, int width, int height)
-		: View(offset, width, height)
+	Wall(int x1, int y1, int x2, int y2)
+		: x1(x1), y1(y1), x2(x2), y2(y2)
 	{
 	};
 
-	void Draw(const std::vector<RayHit> &ray_hits, int map_width) const
+	void Draw(const Canvas &cv, double x_offset, double y_offset, double scale,
+			  const Color &c = Color::White()) const
 	{
-		for (size_t i = 0; i < ray_hits.size(); i++)
-		{
-			int w = width / ray_hits.size();
-			int h = Map(ray_hits[i].dist, 0, map_width, height, 0);
-			double d2 = ray_hits[i].dist * ray_hits[i].dist;
-			uint8_t b = Map(d2, 0, map_width * map_width, 100, 0);
-			Color c = Color::Gray(b);
-			Screen.RectFill(x + i * w, y + (height - h) / 2, w, h, c);
-		}
+		int x1s = round(x1 * scale + x_offset);
+		int y1s = round(y1 * scale + y_offset);
+		int x2s = round(x2 * scale + x_offset);
+		int y2s = round(y2 * scale + y_offset);
 
-		View::Draw();
+		cv.Line(x1s, y1s, x2s, y2s, c);
 	};
 };
 
-class Scene
+// Circle, or an arc when the angles do not cover a full turn
+class Arc
 {
-	static const int map_width = 320;
-	static const int map_height = 240;
+	static constexpr int draw_segments = 32;
 
-	static const int num_walls = 6 + 4;
-	std::vector<Wall> walls;
+public:
+	double cx, cy, r;
+	double a1, a2;	// radians, a2 > a1
 
-	Player neo;
+	Arc(double cx, double cy, double r)
+		: cx(cx), cy(cy), r(r), a1(0.0), a2(2.0 * M_PI)
+	{
+	};
+
+	Arc(double cx, double cy, double r, double deg1, double deg2)
+		: cx(cx), cy(cy), r(r), a1(deg1 * M_PI / 180.0), a2(deg2 * M_PI / 180.0)
+	{
+		if (a2 < a1)
+			a2 += 2.0 * M_PI;
+	};
+
+	bool IsCircle() const
+	{
+		return a2 - a1 >= 2.0 * M_PI;
+	}
+
+	// Position of the point at angle a along the arc, [0, 1] if it is on it
+	double Param(double a) const
+	{
+		double da = fmod(a - a1, 2.0 * M_PI);
+		if (da < 0.0)
+			da += 2.0 * M_PI;
+		return da / (a2 - a1);
+	}
+
+	Vector2 Point(double t) const
+	{
+		double a = Mix(a1, a2, t);
+		return Vector2(cx + r * cos(a), cy + r * sin(a));
+	}
+
+	void Draw(const Canvas &cv, double x_offset, double y_offset, double scale,
+			  const Color &c = Color::White()) const
+	{
+		Vector2 p = Point(0.0);
+		for (int i = 1; i <= draw_segments; i++)
+		{
+			Vector2 q = Point(double(i) / draw_segments);
+			cv.Line(round(p.x * scale + x_offset), round(p.y * scale + y_offset),
+					round(q.x * scale + x_offset), round(q.y * scale + y_offset), c);
+			p = q;
+		}
+	};
+};
+
+// Convex obstacle, vertices stored counter-clockwise
+class Polygon
+{
+public:
+	std::vector<Vector2> pts;
+	std::vector<Vector2> normals;	// outward, one per edge pts[i]..pts[i + 1]
+	double min_x, min_y, max_x, max_y;
+
+	explicit Polygon(const std::vector<Vector2> &vertices): pts(vertices)
+	{
+		double area = 0.0;
+		for (size_t i = 0; i < pts.size(); i++)
+		{
+			const Vector2 &p = pts[i], &q = pts[(i + 1) % pts.size()];
+			area += p.x * q.y - q.x * p.y;
+		}
+		if (area < 0.0)
+			std::reverse(pts.begin(), pts.end());
+
+		min_x = min_y = std::numeric_limits<double>::max();
+		max_x = max_y = -std::numeric_limits<double>::max();
+		for (size_t i = 0; i < pts.size(); i++)
+		{
+			Vector2 e = pts[(i + 1) % pts.size()] - pts[i];
+			normals.push_back(Vector2(e.y, -e.x));
+
+			min_x = std::min(min_x, pts[i].x);
+			min_y = std::min(min_y, pts[i].y);
+			max_x = std::max(max_x, pts[i].x);
+			max_y = std::max(max_y, pts[i].y);
+		}
+	};
+
+	// Whether the vertices, in either order, make a convex polygon with an
+	// area, as Ray::Intersect needs: all turns go the same way, and they
+	// go once around
+	static bool Convex(const std::vector<Vector2> &pts)
+	{
+		int n = pts.size();
+		double sign = 0.0, turned = 0.0;
+
+		for (int i = 0; i < n; i++)
+		{
+			Vector2 e1 = pts[(i + 1) % n] - pts[i];
+			Vector2 e2 = pts[(i + 2) % n] - pts[(i + 1) % n];
+			double cross = e1.x * e2.y - e1.y * e2.x;
+
+			if (cross * sign < 0.0)
+				return false;
+			if (cross != 0.0)
+				sign = cross;
+			turned += atan2(cross, e1 * e2);
+		}
+
+		return sign != 0.0 && fabs(fabs(turned) - 2.0 * M_PI) < 1e-6;
+	}
+
+	void Draw(const Canvas &cv, double x_offset, double y_offset, double scale,
+			  const Color &c = Color::White()) const
+	{
+		for (size_t i = 0; i < pts.size(); i++)
+		{
+			const Vector2 &p = pts[i], &q = pts[(i + 1) % pts.size()];
+			cv.Line(round(p.x * scale + x_offset), round(p.y * scale + y_offset),
+					round(q.x * scale + x_offset), round(q.y * scale + y_offset), c);
+		}
+	};
+};
+
+enum class WallKind : uint8_t
+{
+	Horizontal,
+	Vertical,
+	Slanted
+};
+
+// Horizontal or vertical wall: at is its y or x, lo..hi its extent.
+// Slanted walls only have their id and kind.
+struct AxisWall
+{
+	double at, lo, hi;
+	int id;
+	WallKind kind;
+};
+
+// Everything rays can hit. Primitives are also numbered by a single id:
+// walls first, then arcs, then polygons.
+struct Geometry
+{
+	std::vector<Wall> walls;
+	std::vector<Arc> arcs;
+	std::vector<Polygon> polys;
+
+	// Walls by orientation, see BinWalls, and all of them by id
+	std::vector<AxisWall> h_walls, v_walls;
+	std::vector<int> slanted_walls;
+	std::vector<AxisWall> axis_walls;
+
+	int Count() const
+	{
+		return walls.size() + arcs.size() + polys.size();
+	}
+
+	size_t Bytes() const
+	{
+		size_t n = VectorBytes(walls) + VectorBytes(arcs) + VectorBytes(polys) +
+				   VectorBytes(h_walls) + VectorBytes(v_walls) + VectorBytes(slanted_walls) +
+				   VectorBytes(axis_walls);
+		for (size_t i = 0; i < polys.size(); i++)
+			n += VectorBytes(polys[i].pts) + VectorBytes(polys[i].normals);
+		return n;
+	}
+
+	void Bounds(int id, double &x1, double &y1, double &x2, double &y2) const
+	{
+		if (id < int(walls.size()))
+		{
+			const Wall &w = walls[id];
+			x1 = std::min(w.x1, w.x2);
+			y1 = std::min(w.y1, w.y2);
+			x2 = std::max(w.x1, w.x2);
+			y2 = std::max(w.y1, w.y2);
+			return;
+		}
+		id -= walls.size();
+
+		if (id < int(arcs.size()))
+		{
+			const Arc &a = arcs[id];
+			x1 = a.cx - a.r;
+			y1 = a.cy - a.r;
+			x2 = a.cx + a.r;
+			y2 = a.cy + a.r;
+			return;
+		}
+		id -= arcs.size();
+
+		const Polygon &p = polys[id];
+		x1 = p.min_x;
+		y1 = p.min_y;
+		x2 = p.max_x;
+		y2 = p.max_y;
+	}
+
+	void Draw(int id, const Canvas &cv,
+			  double x_offset, double y_offset, double scale) const
+	{
+		if (id < int(walls.size()))
+			walls[id].Draw(cv, x_offset, y_offset, scale);
+		else if (id < int(walls.size() + arcs.size()))
+			arcs[id - walls.size()].Draw(cv, x_offset, y_offset, scale);
+		else
+			polys[id - walls.size() - arcs.size()].Draw(cv, x_offset, y_offset, scale);
+	}
+
+	// FNV-1a over all the primitives, tells maps apart
+	uint64_t Hash() const
+	{
+		uint64_t h = 14695981039346656037ull;
+		auto add = [&](const void *p, size_t n)
+		{
+			for (size_t i = 0; i < n; i++)
+				h = (h ^ static_cast<const unsigned char *>(p)[i]) * 1099511628211ull;
+		};
+
+		for (size_t i = 0; i < walls.size(); i++)
+		{
+			const Wall &w = walls[i];
+			int v[4] = { w.x1, w.y1, w.x2, w.y2 };
+			add(v, sizeof(v));
+		}
+
+		for (size_t i = 0; i < arcs.size(); i++)
+		{
+			const Arc &a = arcs[i];
+			double v[5] = { a.cx, a.cy, a.r, a.a1, a.a2 };
+			add(v, sizeof(v));
+		}
+
+		for (size_t i = 0; i < polys.size(); i++)
+			add(polys[i].pts.data(), polys[i].pts.size() * sizeof(Vector2));
+
+		return h;
+	}
+
+	// Sort the walls into horizontal, vertical and slanted bins, so the
+	// wall bins caster runs one tight loop per kind, and keep the kind
+	// of every wall for the grid casters. Has to be called again whenever
+	// the walls change.
+	void BinWalls()
+	{
+		h_walls.clear();
+		v_walls.clear();
+		slanted_walls.clear();
+		axis_walls.clear();
+
+		for (int i = 0; i < int(walls.size()); i++)
+		{
+			const Wall &w = walls[i];
+			AxisWall a = { 0.0, 0.0, 0.0, i, WallKind::Slanted };
+
+			if (w.y1 == w.y2 && w.x1 != w.x2)
+			{
+				a = { double(w.y1), double(std::min(w.x1, w.x2)),
+					  double(std::max(w.x1, w.x2)), i, WallKind::Horizontal };
+				h_walls.push_back(a);
+			}
+			else if (w.x1 == w.x2 && w.y1 != w.y2)
+			{
+				a = { double(w.x1), double(std::min(w.y1, w.y2)),
+					  double(std::max(w.y1, w.y2)), i, WallKind::Vertical };
+				v_walls.push_back(a);
+			}
+			else
+				slanted_walls.push_back(i);
+
+			axis_walls.push_back(a);
+		}
+	}
+
+	// Drop the walls in removed, ascending ids, and append added; the
+	// others keep their order. remap gets the new id of every old
+	// primitive, -1 for the dropped walls. Rebuilds the bins.
+	void ReplaceWalls(const std::vector<int> &removed, const std::vector<Wall> &added,
+					  std::vector<int> &remap)
+	{
+		int old_walls = walls.size();
+		remap.resize(Count());
+
+		size_t k = 0;
+		int next = 0;
+		for (int i = 0; i < old_walls; i++)
+		{
+			if (k < removed.size() && removed[k] == i)
+			{
+				remap[i] = -1;
+				k++;
+				continue;
+			}
+			remap[i] = next;
+			walls[next++] = walls[i];
+		}
+
+		walls.erase(walls.begin() + next, walls.end());
+		walls.insert(walls.end(), added.begin(), added.end());
+		for (int i = old_walls; i < int(remap.size()); i++)
+			remap[i] = i - old_walls + walls.size();
+
+		BinWalls();
+	}
+
+	// Put the walls from first on in Z-order of their midpoints, so walls
+	// that are close on the map are close in memory too and a ray walking
+	// the grid touches few cache lines. This renumbers them: anything
+	// keeping wall ids has to be built afterwards.
+	void SortWalls(int first, double map_width, double map_height)
+	{
+		std::vector<std::pair<uint32_t, int>> keys;
+		for (int i = first; i < int(walls.size()); i++)
+		{
+			const Wall &w = walls[i];
+			double mx = std::min(std::max((w.x1 + w.x2) / 2.0 / map_width, 0.0), 1.0);
+			double my = std::min(std::max((w.y1 + w.y2) / 2.0 / map_height, 0.0), 1.0);
+			keys.push_back(std::make_pair(Morton(mx * 0xffff, my * 0xffff), i));
+		}
+		std::sort(keys.begin(), keys.end());
+
+		std::vector<Wall> sorted(walls.begin(), walls.begin() + first);
+		for (size_t i = 0; i < keys.size(); i++)
+			sorted.push_back(walls[keys[i].second]);
+		walls.swap(sorted);
+	}
+};
+
+// Uniform grid over the map, every cell lists the ids of the primitives
+// overlapping it. Cells are packed into one array (counting sort), so a
+// cell's items are items[cell_start[c]] .. items[cell_start[c + 1] - 1].
+class Grid
+{
+	std::vector<int> cell_start;
+	std::vector<int> items;
+
+	std::vector<uint8_t> field;	// optional, see BuildField
+
+public:
+	// Level of detail: a solid rectangle standing in for all walls of a
+	// cell, along the principal axis of the wall pieces inside it
+	struct Proxy
+	{
+		Vector2 center, axis;
+		double half_length, half_width;
+		double lod_dist;	// used from this distance on
+	};
+
+private:
+	// Optional, see BuildProxies; cells without one have index -1
+	std::vector<Proxy> proxies;
+	std::vector<int> proxy_index;
+	double min_lod_dist = std::numeric_limits<double>::infinity();
+
+	// Liang-Barsky, false if nothing of ab is inside the box
+	static bool Clip(Vector2 &a, Vector2 &b, double x1, double y1, double x2, double y2)
+	{
+		double t0 = 0.0, t1 = 1.0;
+		double dx = b.x - a.x, dy = b.y - a.y;
+		double p[4] = { -dx, dx, -dy, dy };
+		double q[4] = { a.x - x1, x2 - a.x, a.y - y1, y2 - a.y };
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (p[i] == 0.0)
+			{
+				if (q[i] < 0.0)
+					return false;
+				continue;
+			}
+
+			double t = q[i] / p[i];
+			if (p[i] < 0.0)
+				t0 = std::max(t0, t);
+			else
+				t1 = std::min(t1, t);
+		}
+
+		if (t0 > t1)
+			return false;
+
+		Vector2 d(dx, dy);
+		b = a + d * t1;
+		a = a + d * t0;
+		return true;
+	}
+
+	// Proxy of cell c, see BuildProxies; false if its walls are too few
+	// or too sparse. pts is scratch space.
+	bool CellProxy(const Geometry &geo, int c, double column_angle,
+				   std::vector<Vector2> &pts, Proxy &proxy) const
+	{
+		double x1 = c % cols * cell, y1 = c / cols * cell;
+		double x2 = x1 + cell, y2 = y1 + cell;
+		const int *items = CellItems(c);
+
+		double length = 0.0;
+		pts.clear();
+		for (int j = 0; j < CellSize(c) && items[j] < int(geo.walls.size()); j++)
+		{
+			const Wall &w = geo.walls[items[j]];
+			Vector2 a(w.x1, w.y1), b(w.x2, w.y2);
+			if (Clip(a, b, x1, y1, x2, y2))
+			{
+				pts.push_back(a);
+				pts.push_back(b);
+				length += (b - a).Length();
+			}
+		}
+
+		if (pts.size() < 4)
+			return false;
+
+		Vector2 mean(0.0, 0.0);
+		for (size_t i = 0; i < pts.size(); i++)
+			mean = mean + pts[i];
+		mean = mean / pts.size();
+
+		double sxx = 0.0, syy = 0.0, sxy = 0.0;
+		for (size_t i = 0; i < pts.size(); i++)
+		{
+			Vector2 d = pts[i] - mean;
+			sxx += d.x * d.x;
+			syy += d.y * d.y;
+			sxy += d.x * d.y;
+		}
+
+		double a = atan2(2.0 * sxy, sxx - syy) / 2.0;
+		Vector2 axis(cos(a), sin(a)), normal(-axis.y, axis.x);
+		double s1 = 0.0, s2 = 0.0, n1 = 0.0, n2 = 0.0;
+		for (size_t i = 0; i < pts.size(); i++)
+		{
+			s1 = std::min(s1, (pts[i] - mean) * axis);
+			s2 = std::max(s2, (pts[i] - mean) * axis);
+			n1 = std::min(n1, (pts[i] - mean) * normal);
+			n2 = std::max(n2, (pts[i] - mean) * normal);
+		}
+
+		if (2.0 * length < 2.0 * ((s2 - s1) + (n2 - n1)))
+			return false;
+
+		proxy.center = mean + axis * ((s1 + s2) / 2.0) + normal * ((n1 + n2) / 2.0);
+		proxy.axis = axis;
+		proxy.half_length = (s2 - s1) / 2.0;
+		proxy.half_width = (n2 - n1) / 2.0;
+		proxy.lod_dist = Vector2(s2 - s1, n2 - n1).Length() / column_angle;
+		return true;
+	}
+
+	// Call f(cell) for every cell the primitive overlaps
+	template <typename F>
+	void ForCells(const Geometry &geo, int id, F &&f) const
+	{
+		double x1, y1, x2, y2;
+		geo.Bounds(id, x1, y1, x2, y2);
+
+		int c1 = CellX(x1), c2 = CellX(x2);
+		int r1 = CellY(y1), r2 = CellY(y2);
+		bool is_wall = id < int(geo.walls.size());
+		double half_diag = cell * M_SQRT1_2;
+
+		for (int r = r1; r <= r2; r++)
+			for (int c = c1; c <= c2; c++)
+			{
+				// Long diagonal walls only go to the cells they pass by
+				if (is_wall)
+				{
+					const Wall &w = geo.walls[id];
+					Vector2 center((c + 0.5) * cell, (r + 0.5) * cell);
+					if (SegmentDistance(center, Vector2(w.x1, w.y1),
+										Vector2(w.x2, w.y2)) > half_diag)
+						continue;
+				}
+				f(r * cols + c);
+			}
+	}
+
+public:
+	double cell = 1.0;
+	int cols = 0, rows = 0;
+
+	Grid() = default;
+
+	// Counting sort split over the pool: every task counts the cells of
+	// its own slice of ids, the counts turn into per task write offsets,
+	// and each task fills its slots. Cells list their ids in order, same
+	// as a serial build would.
+	Grid(const Geometry &geo, int map_width, int map_height, double cell,
+		 WorkerPool &pool = Workers)
+		: cell(cell)
+	{
+		static const int min_ids_per_task = 1024;
+
+		cols = std::max(1, int(ceil(map_width / cell)));
+		rows = std::max(1, int(ceil(map_height / cell)));
+
+		int n = geo.Count();
+		int num_cells = cols * rows;
+		int tasks = std::max(1, std::min(pool.Size(), n / min_ids_per_task));
+		auto part = [&](int total, int i) { return int(int64_t(total) * i / tasks); };
+
+		// counts[t * num_cells + c]: ids of task t in cell c, later
+		// where task t writes its next id of cell c
+		std::vector<int> counts(size_t(tasks) * num_cells, 0);
+		pool.Run(tasks, [&](int t, int)
+		{
+			int *count = counts.data() + size_t(t) * num_cells;
+			for (int id = part(n, t); id < part(n, t + 1); id++)
+				ForCells(geo, id, [&](int c) { count[c]++; });
+		});
+
+		// Prefix sum over (cell, task), each task taking a range of cells
+		std::vector<int> range_start(tasks + 1, 0);
+		pool.Run(tasks, [&](int r, int)
+		{
+			for (int c = part(num_cells, r); c < part(num_cells, r + 1); c++)
+				for (int t = 0; t < tasks; t++)
+					range_start[r + 1] += counts[size_t(t) * num_cells + c];
+		});
+
+		for (int r = 0; r < tasks; r++)
+			range_start[r + 1] += range_start[r];
+
+		cell_start.resize(num_cells + 1);
+		pool.Run(tasks, [&](int r, int)
+		{
+			int start = range_start[r];
+			for (int c = part(num_cells, r); c < part(num_cells, r + 1); c++)
+			{
+				cell_start[c] = start;
+				for (int t = 0; t < tasks; t++)
+				{
+					int &k = counts[size_t(t) * num_cells + c];
+					start += k;
+					k = start - k;
+				}
+			}
+		});
+		cell_start[num_cells] = range_start[tasks];
+
+		items.resize(cell_start.back());
+		pool.Run(tasks, [&](int t, int)
+		{
+			int *fill = counts.data() + size_t(t) * num_cells;
+			for (int id = part(n, t); id < part(n, t + 1); id++)
+				ForCells(geo, id, [&](int c) { items[fill[c]++] = id; });
+		});
+	}
+
+	int CellX(double x) const
+	{
+		return std::min(std::max(int(x / cell), 0), cols - 1);
+	}
+
+	int CellY(double y) const
+	{
+		return std::min(std::max(int(y / cell), 0), rows - 1);
+	}
+
+	int CellSize(int c) const
+	{
+		return cell_start[c + 1] - cell_start[c];
+	}
+
+	const int *CellItems(int c) const
+	{
+		return items.data() + cell_start[c];
+	}
+
+	size_t NumItems() const { return items.size(); }
+
+	size_t Bytes() const { return VectorBytes(cell_start) + VectorBytes(items); }
+	size_t FieldBytes() const { return VectorBytes(field); }
+	size_t ProxyBytes() const { return VectorBytes(proxies) + VectorBytes(proxy_index); }
+
+	bool Contains(double x, double y) const
+	{
+		return x >= 0.0 && y >= 0.0 && x < cols * cell && y < rows * cell;
+	}
+
+	// Cell lists after Geometry::ReplaceWalls, without building them from
+	// scratch: the kept ids are renumbered in one pass over the lists, and
+	// only the added walls, first_added to the last one, are rasterized.
+	// Ids stay in order within a cell. dirty marks the cells that gained
+	// or lost a wall.
+	void Update(const Geometry &geo, const std::vector<int> &remap, int first_added,
+				std::vector<bool> &dirty)
+	{
+		int num_cells = cols * rows;
+		int num_walls = geo.walls.size();
+
+		std::vector<int> add_start(num_cells + 1, 0);
+		for (int id = first_added; id < num_walls; id++)
+			ForCells(geo, id, [&](int c) { add_start[c + 1]++; });
+		for (int c = 0; c < num_cells; c++)
+			add_start[c + 1] += add_start[c];
+
+		std::vector<int> add_items(add_start.back());
+		std::vector<int> fill(add_start.begin(), add_start.end() - 1);
+		for (int id = first_added; id < num_walls; id++)
+			ForCells(geo, id, [&](int c) { add_items[fill[c]++] = id; });
+
+		std::vector<int> new_start(num_cells + 1);
+		std::vector<int> new_items;
+		new_items.reserve(items.size() + add_items.size());
+		dirty.assign(num_cells, false);
+
+		for (int c = 0; c < num_cells; c++)
+		{
+			new_start[c] = new_items.size();
+			const int *it = CellItems(c), *end = it + CellSize(c);
+
+			// Kept walls, then the added ones, then arcs and polygons
+			for (; it < end && remap[*it] < first_added; it++)
+				if (remap[*it] >= 0)
+					new_items.push_back(remap[*it]);
+				else
+					dirty[c] = true;
+
+			new_items.insert(new_items.end(), add_items.begin() + add_start[c],
+							 add_items.begin() + add_start[c + 1]);
+			if (add_start[c + 1] > add_start[c])
+				dirty[c] = true;
+
+			for (; it < end; it++)
+				new_items.push_back(remap[*it]);
+		}
+		new_start[num_cells] = new_items.size();
+
+		cell_start.swap(new_start);
+		items.swap(new_items);
+	}
+
+	// Distance field over the cells: every cell keeps the number of cells
+	// to the nearest nonempty one, in the chessboard metric, from two
+	// sweeps over the grid. Anything is at least that minus one cells
+	// away from any point of the cell.
+	void BuildField()
+	{
+		field.assign(cols * rows, 255);
+		for (int c = 0; c < cols * rows; c++)
+			if (CellSize(c))
+				field[c] = 0;
+
+		auto relax = [&](int r, int c, int dr, int dc)
+		{
+			if (r + dr < 0 || r + dr >= rows || c + dc < 0 || c + dc >= cols)
+				return;
+			uint8_t &k = field[r * cols + c];
+			k = std::min(int(k), field[(r + dr) * cols + c + dc] + 1);
+		};
+
+		for (int r = 0; r < rows; r++)
+			for (int c = 0; c < cols; c++)
+			{
+				relax(r, c, -1, -1);
+				relax(r, c, -1, 0);
+				relax(r, c, -1, 1);
+				relax(r, c, 0, -1);
+			}
+
+		for (int r = rows - 1; r >= 0; r--)
+			for (int c = cols - 1; c >= 0; c--)
+			{
+				relax(r, c, 1, 1);
+				relax(r, c, 1, 0);
+				relax(r, c, 1, -1);
+				relax(r, c, 0, 1);
+			}
+	}
+
+	// Free space around any point of the cell, 0 near anything or
+	// without a field
+	double CellClearance(int c) const
+	{
+		if (field.empty())
+			return 0.0;
+		return std::max(field[c] - 1, 0) * cell;
+	}
+
+	double Clearance(double x, double y) const
+	{
+		return CellClearance(CellY(y) * cols + CellX(x));
+	}
+
+	// Proxies for the cells with two or more walls: the rectangle around
+	// the wall pieces inside the cell, aligned with their principal axis.
+	// Only dense enough clusters get one, where a line through the
+	// rectangle crosses a wall on average (Cauchy-Crofton: 2 * length of
+	// the walls over the perimeter), so from afar they look solid. A
+	// proxy takes over once the cluster fits in one column, column_angle
+	// in radians.
+	void BuildProxies(const Geometry &geo, double column_angle,
+					  WorkerPool &pool = Workers)
+	{
+		std::vector<std::vector<Proxy>> row_proxies(rows);
+		proxy_index.assign(cols * rows, -1);
+
+		pool.Run(rows, [&](int r, int)
+		{
+			std::vector<Vector2> pts;
+
+			for (int c = 0; c < cols; c++)
+			{
+				Proxy proxy;
+				if (!CellProxy(geo, r * cols + c, column_angle, pts, proxy))
+					continue;
+
+				proxy_index[r * cols + c] = row_proxies[r].size();
+				row_proxies[r].push_back(proxy);
+			}
+		});
+
+		// Rows in order, indices shifted to where each row starts
+		proxies.clear();
+		for (int r = 0; r < rows; r++)
+		{
+			for (int c = 0; c < cols; c++)
+				if (proxy_index[r * cols + c] >= 0)
+					proxy_index[r * cols + c] += proxies.size();
+			proxies.insert(proxies.end(), row_proxies[r].begin(), row_proxies[r].end());
+		}
+
+		min_lod_dist = std::numeric_limits<double>::infinity();
+		for (size_t i = 0; i < proxies.size(); i++)
+			min_lod_dist = std::min(min_lod_dist, proxies[i].lod_dist);
+	}
+
+	// Proxies again for the dirty cells only. The ones they replace stay
+	// unused in the array; once that is half garbage, all are rebuilt.
+	void UpdateProxies(const Geometry &geo, double column_angle,
+					   const std::vector<bool> &dirty)
+	{
+		std::vector<Vector2> pts;
+		size_t live = 0;
+
+		for (int c = 0; c < cols * rows; c++)
+		{
+			if (dirty[c])
+			{
+				Proxy proxy;
+				proxy_index[c] = -1;
+				if (CellProxy(geo, c, column_angle, pts, proxy))
+				{
+					proxy_index[c] = proxies.size();
+					proxies.push_back(proxy);
+				}
+			}
+			live += proxy_index[c] >= 0;
+		}
+
+		if (2 * live < proxies.size())
+		{
+			BuildProxies(geo, column_angle);
+			return;
+		}
+
+		min_lod_dist = std::numeric_limits<double>::infinity();
+		for (int c = 0; c < cols * rows; c++)
+			if (proxy_index[c] >= 0)
+				min_lod_dist = std::min(min_lod_dist, proxies[proxy_index[c]].lod_dist);
+	}
+
+	void ClearProxies()
+	{
+		proxies.clear();
+		proxy_index.clear();
+		min_lod_dist = std::numeric_limits<double>::infinity();
+	}
+
+	bool HasProxies() const { return !proxy_index.empty(); }
+
+	// Proxy of cell c if it stands in for the walls at distance t
+	const Proxy *GetProxy(int c, double t) const
+	{
+		// Most cells are empty or near, so the index is seldom touched
+		if (CellSize(c) < 2 || t < min_lod_dist || proxy_index[c] < 0)
+			return nullptr;
+
+		const Proxy &proxy = proxies[proxy_index[c]];
+		return t < proxy.lod_dist ? nullptr : &proxy;
+	}
+
+	// Ids of all primitives overlapping the rectangle, without duplicates
+	template <typename Vec>
+	void Query(double x1, double y1, double x2, double y2, Vec &res) const
+	{
+		res.clear();
+
+		for (int r = CellY(y1); r <= CellY(y2); r++)
+			for (int c = CellX(x1); c <= CellX(x2); c++)
+				res.insert(res.end(), CellItems(r * cols + c),
+						   CellItems(r * cols + c) + CellSize(r * cols + c));
+
+		std::sort(res.begin(), res.end());
+		res.erase(std::unique(res.begin(), res.end()), res.end());
+	}
+};
+
+class Ray
+{
+	double x, y;
+	Angle angle;
+	Vector2 dir;
+	double inv_x, inv_y;	// 1 / dir, 0 where dir is 0
+
+	void Aim()
+	{
+		dir = Vector2(angle);
+		inv_x = dir.x ? 1.0 / dir.x : 0.0;
+		inv_y = dir.y ? 1.0 / dir.y : 0.0;
+	}
+
+public:
+	Ray() = default;
+
+	Ray(double x, double y, Angle a): x(x), y(y), angle(a)
+	{
+		Aim();
+	};
+
+	Vector2 GetOrigin() const
+	{
+		return Vector2(x, y);
+	}
+
+	Angle GetAngle() const
+	{
+		return angle;
+	}
+
+	const Vector2 &GetDir() const
+	{
+		return dir;
+	}
+
+	void Rotate(double da)
+	{
+		angle += da;
+		Aim();
+	}
+
+	void MoveTo(double new_x, double new_y)
+	{
+		x = new_x;
+		y = new_y;
+	}
+
+	Vector2 At(double t) const
+	{
+		return Vector2(x, y) + dir * t;
+	}
+
+	bool Intersect(const Wall &wall, double &tw, double &tr) const
+	{
+		double nwx = wall.y2 - wall.y1;
+		double nwy = wall.x1 - wall.x2;
+		double nrx = dir.y;
+		double nry = -dir.x;
+
+		double den = nry * nwx - nrx * nwy;
+
+		if (den == 0.0)	// exact checking is ok here
+			return false;
+
+		tw = -(nrx * (wall.x1 - x) + nry * (wall.y1 - y)) / den;
+		tr = -(nwy * (wall.y1 - y) + nwx * (wall.x1 - x)) / den;
+
+		return tw > 0.0 && tw < 1.0 && tr > 0.0;
+	};
+
+	// Same for this ray and the parallel one from origin o, which share
+	// the division. Bit 0 of the result is set if this ray hits, bit 1 if
+	// the other one does; tw[1] and tr[1] are the other one's.
+	int Intersect(const Wall &wall, const Vector2 &o, double tw[2], double tr[2]) const
+	{
+		double nwx = wall.y2 - wall.y1;
+		double nwy = wall.x1 - wall.x2;
+		double nrx = dir.y;
+		double nry = -dir.x;
+
+		double den = nry * nwx - nrx * nwy;
+
+		if (den == 0.0)
+			return 0;
+
+		double inv = 1.0 / den;
+		int res = 0;
+		for (int k = 0; k < 2; k++)
+		{
+			double dx = wall.x1 - (k ? o.x : x);
+			double dy = wall.y1 - (k ? o.y : y);
+			tw[k] = -(nrx * dx + nry * dy) * inv;
+			tr[k] = -(nwy * dy + nwx * dx) * inv;
+			res |= (tw[k] > 0.0 && tw[k] < 1.0 && tr[k] > 0.0) << k;
+		}
+		return res;
+	}
+
+	// Slab test against a solid rectangle given by its center, unit axis
+	// and half sizes along the axis and across it. Only hits from outside.
+	bool Intersect(const Vector2 &center, const Vector2 &axis,
+				   double half_length, double half_width, double &tr) const
+	{
+		Vector2 normal(-axis.y, axis.x);
+		Vector2 o = Vector2(x, y) - center;
+		double pos[2] = { o * axis, o * normal };
+		double vel[2] = { dir * axis, dir * normal };
+		double half[2] = { half_length, half_width };
+		double t_enter = -std::numeric_limits<double>::max();
+		double t_exit = std::numeric_limits<double>::max();
+
+		for (int i = 0; i < 2; i++)
+		{
+			if (vel[i] == 0.0)
+			{
+				if (fabs(pos[i]) > half[i])
+					return false;
+				continue;
+			}
+
+			double t1 = (-half[i] - pos[i]) / vel[i];
+			double t2 = (half[i] - pos[i]) / vel[i];
+			t_enter = std::max(t_enter, std::min(t1, t2));
+			t_exit = std::min(t_exit, std::max(t1, t2));
+		}
+
+		tr = t_enter;
+		return t_enter <= t_exit && t_enter > 0.0;
+	}
+
+	// Horizontal wall at y = wy spanning lo..hi: no division, the
+	// reciprocal of the direction is kept with the ray
+	bool IntersectH(double wy, double lo, double hi, double &tr) const
+	{
+		tr = (wy - y) * inv_y;
+		double hx = x + dir.x * tr;
+		return tr > 0.0 && hx > lo && hx < hi;
+	}
+
+	// Vertical wall at x = wx spanning lo..hi
+	bool IntersectV(double wx, double lo, double hi, double &tr) const
+	{
+		tr = (wx - x) * inv_x;
+		double hy = y + dir.y * tr;
+		return tr > 0.0 && hy > lo && hy < hi;
+	}
+
+	// Closed-form ray-circle test, then the nearer root lying on the arc
+	bool Intersect(const Arc &arc, double &ta, double &tr) const
+	{
+		double ox = x - arc.cx;
+		double oy = y - arc.cy;
+		double b = ox * dir.x + oy * dir.y;
+		double c = ox * ox + oy * oy - arc.r * arc.r;
+		double disc = b * b - c;
+
+		if (disc < 0.0)
+			return false;
+
+		double s = sqrt(disc);
+		double roots[2] = { -b - s, -b + s };
+
+		for (int i = 0; i < 2; i++)
+		{
+			if (roots[i] <= 0.0)
+				continue;
+
+			double hx = ox + dir.x * roots[i];
+			double hy = oy + dir.y * roots[i];
+			ta = arc.Param(atan2(hy, hx));
+
+			if (arc.IsCircle() || ta <= 1.0)
+			{
+				tr = roots[i];
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	// Cyrus-Beck clipping against all edges at once, after a slab test
+	// against the bounding box. From inside the polygon the exit is hit.
+	bool Intersect(const Polygon &poly, double &tr) const
+	{
+		double t_enter = 0.0;
+		double t_exit = std::numeric_limits<double>::max();
+
+		if (dir.x != 0.0)
+		{
+			double t1 = (poly.min_x - x) / dir.x;
+			double t2 = (poly.max_x - x) / dir.x;
+			t_enter = std::max(t_enter, std::min(t1, t2));
+			t_exit = std::min(t_exit, std::max(t1, t2));
+		}
+		else if (x < poly.min_x || x > poly.max_x)
+			return false;
+
+		if (dir.y != 0.0)
+		{
+			double t1 = (poly.min_y - y) / dir.y;
+			double t2 = (poly.max_y - y) / dir.y;
+			t_enter = std::max(t_enter, std::min(t1, t2));
+			t_exit = std::min(t_exit, std::max(t1, t2));
+		}
+		else if (y < poly.min_y || y > poly.max_y)
+			return false;
+
+		if (t_enter > t_exit)
+			return false;
+
+		t_enter = 0.0;
+		t_exit = std::numeric_limits<double>::max();
+		bool entered = false;
+
+		for (size_t i = 0; i < poly.pts.size(); i++)
+		{
+			const Vector2 &n = poly.normals[i];
+			double num = n.x * (poly.pts[i].x - x) + n.y * (poly.pts[i].y - y);
+			double den = n * dir;
+
+			if (den == 0.0)
+			{
+				if (num < 0.0)
+					return false;	// parallel and outside this edge
+				continue;
+			}
+
+			double t = num / den;
+			if (den < 0.0)
+			{
+				if (t > t_enter)
+				{
+					t_enter = t;
+					entered = true;
+				}
+			}
+			else
+				t_exit = std::min(t_exit, t);
+
+			if (t_enter > t_exit)
+				return false;
+		}
+
+		tr = entered ? t_enter : t_exit;
+		return tr > 0.0;
+	};
+};
+
+struct RayHit
+{
+	double dist, wall_x, wall_y;
+};
+
+// How primary rays find the nearest primitive
+enum class Caster
+{
+	Brute,	// against everything, the reference
+	Grid,	// one ray at a time through the grid cells
+	Packet,	// bundles of neighbouring rays through the grid together
+	Field,	// sphere tracing over the grid's distance field
+	Bins	// one tight loop per kind of wall, see Geometry::BinWalls
+};
+
+static const int num_casters = 5;
+
+const char *CasterName(Caster caster)
+{
+	static const char *names[num_casters] = { "brute force", "grid", "grid packets",
+											  "distance field", "wall bins" };
+	return names[int(caster)];
+}
+
+class Player
+{
+	double x, y;
+	Angle heading = Angle();
+	std::vector<Ray> rays;
+	static constexpr int num_rays = 320;
+	static constexpr double view_angle = 60.0;
+	static constexpr double eye_dist = 2.0;
+	static constexpr int packet_size = 16;
+	static constexpr int packet_max_cells = 4;	// wedge width that splits a packet
+	double far_plane = std::numeric_limits<double>::infinity();
+
+public:
+	Player() = default;
+
+	Player(double x, double y): x(x), y(y)
+	{
+		AimRays();
+	};
+
+	// Cast the rays afresh from the player's position and heading
+	void AimRays()
+	{
+		rays.clear();
+		Angle a = heading - view_angle / 2.0;
+		for (int i = 0; i < num_rays; i++)
+		{
+			rays.push_back(Ray(x, y, a));
+			a += view_angle / num_rays;
+		}
+	}
+
+	// Nothing blocks the way from a to b. Exact, wall proxies are for
+	// drawing only.
+	static bool LineOfSight(const Geometry &geo, const Grid &grid, Vector2 a, Vector2 b)
+	{
+		Vector2 d = b - a;
+		Angle dir = Angle();
+		dir += atan2(d.y, d.x) * 180.0 / M_PI;
+
+		double tw, tr;
+		return CastGrid(geo, grid, Ray(a.x, a.y, dir), false, tw, tr, d.Length(),
+						false) < 0;
+	}
+
+	void SetPose(double new_x, double new_y, Angle new_heading)
+	{
+		x = new_x;
+		y = new_y;
+		heading = new_heading;
+		AimRays();
+	}
+
+	double GetX() const { return x; }
+	double GetY() const { return y; }
+	Angle GetHeading() const { return heading; }
+
+	static int NumRays() { return num_rays; }
+	static double ViewAngle() { return view_angle; }
+
+	// Nothing beyond the far plane is hit, misses are past it
+	double GetFarPlane() const { return far_plane; }
+	void SetFarPlane(double dist) { far_plane = dist; }
+
+	bool CanMove(double dd, int map_width, int map_height) const
+	{
+		Vector2 dir(heading);
+		int new_x = round(x + dir.x * dd);
+		int new_y = round(y + dir.y * dd);
+
+		if (new_x < 1 || new_y < 1)
+			return false;
+
+		if (new_x >= map_width - 1 || new_y >= map_height - 1)
+			return false;
+
+		return true;
+	}
+
+	void Rotate(double da)
+	{
+		heading += da;
+		for (size_t i = 0; i < rays.size(); i++)
+			rays[i].Rotate(da);
+	}
+
+	void Move(double dd)
+	{
+		Vector2 dir(heading);
+		x += dir.x * dd;
+		y += dir.y * dd;
+
+		for (size_t i = 0; i < rays.size(); i++)
+			rays[i].MoveTo(x, y);
+	}
+
+private:
+	// Where p lies along the horizontal or vertical wall, 0 at its first end
+	static double AxisParam(const Wall &w, const Vector2 &p)
+	{
+		return w.y1 == w.y2 ? (p.x - w.x1) / (w.x2 - w.x1)
+							: (p.y - w.y1) / (w.y2 - w.y1);
+	}
+
+	// Ray against the primitive with the given id. Horizontal and vertical
+	// walls, as binned by Geometry::BinWalls, leave tw for AxisHit, which
+	// only the nearest hit needs.
+	static bool Intersect(const Geometry &geo, const Ray &ray, int id,
+						  double &tw, double &tr)
+	{
+		if (id < int(geo.walls.size()))
+		{
+			const AxisWall &a = geo.axis_walls[id];
+			switch (a.kind)
+			{
+				case WallKind::Horizontal:
+					tw = 0.0;
+					return ray.IntersectH(a.at, a.lo, a.hi, tr);
+				case WallKind::Vertical:
+					tw = 0.0;
+					return ray.IntersectV(a.at, a.lo, a.hi, tr);
+				default:
+					return ray.Intersect(geo.walls[id], tw, tr);
+			}
+		}
+		id -= geo.walls.size();
+
+		if (id < int(geo.arcs.size()))
+			return ray.Intersect(geo.arcs[id], tw, tr);
+		id -= geo.arcs.size();
+
+		tw = 0.0;
+		return ray.Intersect(geo.polys[id], tr);
+	}
+
+	// tw of a hit found by Intersect, if it is on a horizontal or vertical wall
+	static void AxisHit(const Geometry &geo, const Ray &ray, int id, double tr, double &tw)
+	{
+		if (id >= 0 && id < int(geo.walls.size()) &&
+			geo.axis_walls[id].kind != WallKind::Slanted)
+			tw = AxisParam(geo.walls[id], ray.At(tr));
+	}
+
+	// Ray against the items of grid cell c, entered at distance t. Where
+	// the cell has a proxy for that distance, and use_proxies is set, it
+	// replaces the walls; a proxy hit gets the id geo.Count() + c.
+	static void IntersectCell(const Geometry &geo, const Grid &grid, const Ray &ray,
+							  int c, double t, bool use_proxies,
+							  int &id_hit, double &tw_hit, double &tr_hit)
+	{
+		const Grid::Proxy *proxy = use_proxies ? grid.GetProxy(c, t) : nullptr;
+		const int *items = grid.CellItems(c);
+		const int *end = items + grid.CellSize(c);
+
+		if (proxy)
+		{
+			double tr;
+			items = std::lower_bound(items, end, int(geo.walls.size()));
+			if (ray.Intersect(proxy->center, proxy->axis, proxy->half_length,
+							  proxy->half_width, tr) && tr < tr_hit)
+			{
+				id_hit = geo.Count() + c;
+				tr_hit = tr;
+				tw_hit = 0.0;
+			}
+		}
+
+		for (; items < end; items++)
+		{
+			double tw, tr;
+			if (Intersect(geo, ray, *items, tw, tr) && tr < tr_hit)
+			{
+				id_hit = *items;
+				tr_hit = tr;
+				tw_hit = tw;
+			}
+		}
+	}
+
+	// Nearest hit of one ray against the curved and polygonal primitives,
+	// updates id_hit/tw_hit/tr_hit only if something is closer
+	static void IntersectSolids(const Geometry &geo, const Ray &ray,
+								int &id_hit, double &tw_hit, double &tr_hit)
+	{
+		int base = geo.walls.size();
+		for (size_t j = 0; j < geo.arcs.size(); j++)
+		{
+			double ta, tr;
+			if (ray.Intersect(geo.arcs[j], ta, tr))
+				if (tr < tr_hit)
+				{
+					id_hit = base + j;
+					tr_hit = tr;
+					tw_hit = ta;
+				}
+		}
+
+		base += geo.arcs.size();
+		for (size_t j = 0; j < geo.polys.size(); j++)
+		{
+			double tr;
+			if (ray.Intersect(geo.polys[j], tr))
+				if (tr < tr_hit)
+				{
+					id_hit = base + j;
+					tr_hit = tr;
+				}
+		}
+	}
+
+	// Search limit along the ray, where it crosses the far plane
+	double FarLimit(const Ray &ray) const
+	{
+		return far_plane / Cos(ray.GetAngle() - heading);
+	}
+
+	RayHit MakeHit(const Geometry &geo, const Ray &ray,
+				   int id, double tw, double tr) const
+	{
+		return MakeHit(geo, ray, id, tw, tr, Cos(ray.GetAngle() - heading));
+	}
+
+	// Same with the cosine of the ray to the heading, which is shared by
+	// rays with the same angle
+	RayHit MakeHit(const Geometry &geo, const Ray &ray, int id, double tw,
+				   double tr, double cos_a) const
+	{
+		double dist = tr * cos_a;
+
+		if (id < int(geo.walls.size()))
+		{
+			const Wall &w = geo.walls[id];
+			return { .dist = dist,
+					 .wall_x = Mix(w.x1, w.x2, tw),
+					 .wall_y = Mix(w.y1, w.y2, tw) };
+		}
+
+		Vector2 p = id < int(geo.walls.size() + geo.arcs.size())
+			? geo.arcs[id - geo.walls.size()].Point(tw)
+			: ray.At(tr);
+		return { .dist = dist, .wall_x = p.x, .wall_y = p.y };
+	}
+
+	// Nearest primitive along the ray closer than far, -1 if there is none.
+	// Every wall is tested with Ray::Intersect, nothing else is assumed, so
+	// this is the reference the other casters are validated against.
+	static int CastBrute(const Geometry &geo, const Ray &ray, double &tw_hit,
+						 double &tr_hit, double far)
+	{
+		int id_hit = -1;
+		tw_hit = 0.0;
+		tr_hit = far;
+
+		for (size_t j = 0; j < geo.walls.size(); j++)
+		{
+			double tw, tr;
+			if (ray.Intersect(geo.walls[j], tw, tr) && tr < tr_hit)
+			{
+				id_hit = j;
+				tr_hit = tr;
+				tw_hit = tw;
+			}
+		}
+
+		IntersectSolids(geo, ray, id_hit, tw_hit, tr_hit);
+
+		return id_hit;
+	}
+
+	// Same as CastBrute, but walls go by the bins of Geometry::BinWalls;
+	// for horizontal and vertical ones only the nearest hit needs a
+	// division, at the end.
+	static int Cast(const Geometry &geo, const Ray &ray, double &tw_hit, double &tr_hit,
+					double far = std::numeric_limits<double>::infinity())
+	{
+		int id_hit = -1;
+		tw_hit = 0.0;
+		tr_hit = far;
+
+		for (size_t j = 0; j < geo.h_walls.size(); j++)
+		{
+			const AxisWall &w = geo.h_walls[j];
+			double tr;
+			if (ray.IntersectH(w.at, w.lo, w.hi, tr) && tr < tr_hit)
+			{
+				id_hit = w.id;
+				tr_hit = tr;
+			}
+		}
+
+		for (size_t j = 0; j < geo.v_walls.size(); j++)
+		{
+			const AxisWall &w = geo.v_walls[j];
+			double tr;
+			if (ray.IntersectV(w.at, w.lo, w.hi, tr) && tr < tr_hit)
+			{
+				id_hit = w.id;
+				tr_hit = tr;
+			}
+		}
+
+		if (id_hit >= 0)
+			tw_hit = AxisParam(geo.walls[id_hit], ray.At(tr_hit));
+
+		for (size_t j = 0; j < geo.slanted_walls.size(); j++)
+		{
+			int id = geo.slanted_walls[j];
+			double tw, tr;
+			if (ray.Intersect(geo.walls[id], tw, tr) && tr < tr_hit)
+			{
+				id_hit = id;
+				tr_hit = tr;
+				tw_hit = tw;
+			}
+		}
+
+		IntersectSolids(geo, ray, id_hit, tw_hit, tr_hit);
+
+		return id_hit;
+	}
+
+	// Same as Cast, walking the grid cells along the ray (Amanatides-Woo)
+	// and stopping at the first cell that contains the nearest hit so far.
+	// With use_field it sphere traces too: in open space, as told by the
+	// grid's distance field, the ray jumps ahead by the clearance, and it
+	// only goes cell by cell, testing items, near geometry. Either way
+	// the walk ends at far. Without use_proxies it ignores the grid's wall
+	// proxies and only hits actual primitives.
+	static int CastGrid(const Geometry &geo, const Grid &grid, const Ray &ray,
+						bool use_field, double &tw_hit, double &tr_hit,
+						double far = std::numeric_limits<double>::infinity(),
+						bool use_proxies = true)
+	{
+		int id_hit = WalkGrid(geo, grid, ray, use_field, tw_hit, tr_hit, far, use_proxies);
+		AxisHit(geo, ray, id_hit, tr_hit, tw_hit);
+		return id_hit;
+	}
+
+	// CastGrid, but tw of horizontal and vertical walls is left to AxisHit
+	static int WalkGrid(const Geometry &geo, const Grid &grid, const Ray &ray,
+						bool use_field, double &tw_hit, double &tr_hit, double far,
+						bool use_proxies)
+	{
+		static constexpr double inf = std::numeric_limits<double>::infinity();
+		Vector2 o = ray.At(0.0);
+		const Vector2 &dir = ray.GetDir();
+		int id_hit = -1;
+		tw_hit = 0.0;
+		tr_hit = far;
+
+		for (double t = 0.0; t < tr_hit;)
+		{
+			Vector2 p = o + dir * t;
+			if (t > 0.0 && !grid.Contains(p.x, p.y))
+				break;
+
+			double clearance = use_field ? grid.Clearance(p.x, p.y) : 0.0;
+			if (clearance > 0.0)
+			{
+				t += clearance;
+				continue;
+			}
+
+			int cx = grid.CellX(p.x), cy = grid.CellY(p.y);
+			int step_x = dir.x > 0.0 ? 1 : -1;
+			int step_y = dir.y > 0.0 ? 1 : -1;
+			double t_max_x = dir.x ? ((cx + (dir.x > 0.0)) * grid.cell - o.x) / dir.x : inf;
+			double t_max_y = dir.y ? ((cy + (dir.y > 0.0)) * grid.cell - o.y) / dir.y : inf;
+			double t_delta_x = dir.x ? grid.cell / fabs(dir.x) : inf;
+			double t_delta_y = dir.y ? grid.cell / fabs(dir.y) : inf;
+
+			for (;;)
+			{
+				IntersectCell(geo, grid, ray, cy * grid.cols + cx, t, use_proxies,
+							  id_hit, tw_hit, tr_hit);
+
+				t = std::min(t_max_x, t_max_y);
+				if (tr_hit <= t)
+					return id_hit;
+
+				if (t_max_x < t_max_y)
+				{
+					cx += step_x;
+					t_max_x += t_delta_x;
+					if (cx < 0 || cx >= grid.cols)
+						return id_hit;
+				}
+				else
+				{
+					cy += step_y;
+					t_max_y += t_delta_y;
+					if (cy < 0 || cy >= grid.rows)
+						return id_hit;
+				}
+
+				// Back in open space, continue from just inside the cell
+				if (use_field && grid.CellClearance(cy * grid.cols + cx) > 0.0)
+				{
+					t += 1e-6 * grid.cell;
+					break;
+				}
+			}
+		}
+
+		return id_hit;
+	}
+
+	// Nearest primitive along the ray with one of the single ray casters
+	static int Cast(const Geometry &geo, const Grid &grid, Caster caster,
+					const Ray &ray, double &tw, double &tr, double far)
+	{
+		switch (caster)
+		{
+			case Caster::Grid:
+			case Caster::Packet:
+				return CastGrid(geo, grid, ray, false, tw, tr, far);
+			case Caster::Field:
+				return CastGrid(geo, grid, ray, true, tw, tr, far);
+			case Caster::Brute:
+				return CastBrute(geo, ray, tw, tr, far);
+			default:
+				return Cast(geo, ray, tw, tr, far);
+		}
+	}
+
+	// Rays rs[0, n) cast together, up to packet_size per origin. They
+	// come from one origin, or from two with the same directions, the
+	// first half from one and the second from the other (the eyes of a
+	// stereo pair). The rays of an origin make a wedge; the packet walks
+	// the grid in slices across its main axis, and the items of the cells
+	// the wedges cover in a slice are tested against all its rays still
+	// without a hit.
+	// A ray is done once its hit, or its far plane limit, is nearer than
+	// the far side of the slice. When the wedges get wider than
+	// packet_max_cells the rays share too little, and the rest of them
+	// go on one by one.
+	void CastPacket(const Geometry &geo, const Grid &grid, const Ray *rs, int n,
+					int origins, int *ids, double *tws, double *trs) const
+	{
+		WalkPacket(geo, grid, rs, n, origins, ids, tws, trs);
+		for (int i = 0; i < n; i++)
+			AxisHit(geo, rs[i], ids[i], trs[i], tws[i]);
+	}
+
+	// CastPacket, but tw of horizontal and vertical walls may be left to
+	// AxisHit
+	void WalkPacket(const Geometry &geo, const Grid &grid, const Ray *rs, int n,
+					int origins, int *ids, double *tws, double *trs) const
+	{
+		int m = n / origins;	// rays per origin
+		Vector2 d[2 * packet_size];
+		for (int i = 0; i < n; i++)
+		{
+			d[i] = rs[i].GetDir();
+			ids[i] = -1;
+			tws[i] = 0.0;
+			trs[i] = i < m ? FarLimit(rs[i]) : trs[i - m];	// same angle
+		}
+
+		auto split = [&](uint32_t active)
+		{
+			for (int i = 0; i < n; i++)
+				if (active >> i & 1)
+					ids[i] = CastGrid(geo, grid, rs[i], false, tws[i], trs[i],
+									  FarLimit(rs[i]));
+		};
+
+		// Main axis u of the packet, v across it
+		const Vector2 &mid = d[m / 2];
+		bool along_y = fabs(mid.y) > fabs(mid.x);
+		auto u = [&](const Vector2 &p) { return along_y ? p.y : p.x; };
+		auto v = [&](const Vector2 &p) { return along_y ? p.x : p.y; };
+		int step = u(mid) > 0.0 ? 1 : -1;
+		int u_cells = along_y ? grid.rows : grid.cols;
+		int v_cells = along_y ? grid.cols : grid.rows;
+
+		Vector2 o[2];
+		double ou[2], ov[2];
+		for (int e = 0; e < origins; e++)
+		{
+			o[e] = rs[e * m].GetOrigin();
+			ou[e] = u(o[e]);
+			ov[e] = v(o[e]);
+		}
+
+		uint32_t active = uint32_t((uint64_t(1) << n) - 1);
+		for (int i = 0; i < n; i++)
+			if (u(d[i]) * step < 0.5)	// too steep for slices along u
+				return split(active);
+
+		// Primitives entirely outside one of the outer rays of a wedge are
+		// skipped for the rays of its origin; inside gives the rays left
+		auto cross = [](const Vector2 &a, const Vector2 &b) { return a.x * b.y - a.y * b.x; };
+		double inner[2] = { cross(d[0], d[m - 1]), cross(d[m - 1], d[0]) };
+		uint32_t wedge = uint32_t((uint64_t(1) << m) - 1);
+		auto inside = [&](int id)
+		{
+			double x1, y1, x2, y2;
+			geo.Bounds(id, x1, y1, x2, y2);
+
+			uint32_t res = 0;
+			for (int e = 0; e < origins; e++)
+			{
+				Vector2 corners[4] = { Vector2(x1, y1) - o[e], Vector2(x2, y1) - o[e],
+									   Vector2(x1, y2) - o[e], Vector2(x2, y2) - o[e] };
+				bool out = false;
+				for (int side = 0; side < 2 && !out; side++)
+				{
+					const Vector2 &edge = d[side ? m - 1 : 0];
+					int k = 0;
+					while (k < 4 && cross(edge, corners[k]) * inner[side] < -1e-9)
+						k++;
+					out = k == 4;
+				}
+				if (!out)
+					res |= wedge << (e * m);
+			}
+			return res;
+		};
+
+		// Slice bounds b as seen from origin e, which may not be in it yet
+		auto from = [&](double b, int e)
+		{
+			return step > 0 ? std::max(b, ou[e]) : std::min(b, ou[e]);
+		};
+
+		double start = step > 0 ? std::min(ou[0], ou[origins - 1])
+								: std::max(ou[0], ou[origins - 1]);
+		for (int k = int(floor(start / grid.cell)); active && k >= 0 && k < u_cells; k += step)
+		{
+			double near = step > 0 ? k * grid.cell : (k + 1) * grid.cell;
+			double far = step > 0 ? (k + 1) * grid.cell : k * grid.cell;
+
+			// Extent of the wedges in the slice, between their outer rays
+			double v1 = std::numeric_limits<double>::max(), v2 = -v1;
+			for (int e = 0; e < origins; e++)
+				for (int side = 0; side < 2; side++)
+				{
+					const Vector2 &edge = d[side ? m - 1 : 0];
+					for (double b : { from(near, e), from(far, e) })
+					{
+						double vb = ov[e] + v(edge) * (b - ou[e]) / u(edge);
+						v1 = std::min(v1, vb);
+						v2 = std::max(v2, vb);
+					}
+				}
+
+			int c1 = std::max(int(floor(v1 / grid.cell - 1e-9)), 0);
+			int c2 = std::min(int(floor(v2 / grid.cell + 1e-9)), v_cells - 1);
+			if (c1 > c2)
+				break;
+			if (c2 - c1 >= packet_max_cells)
+				return split(active);
+
+			double t_near = std::numeric_limits<double>::max();
+			for (int i = 0; i < n; i++)
+				t_near = std::min(t_near, (from(near, i / m) - ou[i / m]) / u(d[i]));
+
+			for (int c = c1; c <= c2; c++)
+			{
+				int cell = along_y ? k * grid.cols + c : c * grid.cols + k;
+				const Grid::Proxy *proxy = grid.GetProxy(cell, t_near);
+				const int *items = grid.CellItems(cell);
+
+				for (int i = 0; proxy && i < n; i++)
+				{
+					double tr;
+					if ((active >> i & 1) &&
+						rs[i].Intersect(proxy->center, proxy->axis, proxy->half_length,
+										proxy->half_width, tr) && tr < trs[i])
+					{
+						ids[i] = geo.Count() + cell;
+						trs[i] = tr;
+						tws[i] = 0.0;
+					}
+				}
+
+				for (int j = 0; j < grid.CellSize(cell); j++)
+				{
+					if (proxy && items[j] < int(geo.walls.size()))
+						continue;
+
+					uint32_t test = active & inside(items[j]);
+					// Columns where both eyes still look: their rays only
+					// differ in the origin, so a slanted wall takes one
+					// division for the two
+					uint32_t both = origins == 2 && items[j] < int(geo.walls.size()) &&
+						geo.axis_walls[items[j]].kind == WallKind::Slanted
+						? test & test >> m & wedge : 0;
+					test &= ~(both | both << m);
+
+					for (int i = 0; both >> i; i++)
+					{
+						if (!(both >> i & 1))
+							continue;
+
+						double tw[2], tr[2];
+						int hit = rs[i].Intersect(geo.walls[items[j]], o[1], tw, tr);
+						for (int e = 0; e < 2; e++)
+						{
+							int k = e * m + i;
+							if ((hit >> e & 1) && tr[e] < trs[k])
+							{
+								ids[k] = items[j];
+								trs[k] = tr[e];
+								tws[k] = tw[e];
+							}
+						}
+					}
+
+					for (int i = 0; test && i < n; i++)
+					{
+						double tw, tr;
+						if ((test >> i & 1) &&
+							Intersect(geo, rs[i], items[j], tw, tr) && tr < trs[i])
+						{
+							ids[i] = items[j];
+							trs[i] = tr;
+							tws[i] = tw;
+						}
+					}
+				}
+			}
+
+			for (int i = 0; i < n; i++)
+				if (trs[i] <= (far - ou[i / m]) / u(d[i]))
+					active &= ~(uint32_t(1) << i);
+		}
+	}
+
+public:
+	// Hits of rays [first, first + n). Misses, including everything past
+	// the far plane, are at infinite distance, on the player, so they
+	// draw nothing. If hit_ids is given it gets the primitive each ray
+	// hit, -1 for a miss and Geometry::Count() + cell for a wall proxy.
+	void CalcRayHits(const Geometry &geo, const Grid &grid, Caster caster,
+					 int first, int n, RayHit *hits, int *hit_ids = nullptr) const
+	{
+		int ids[packet_size];
+		double tws[packet_size], trs[packet_size];
+
+		for (int p = first; p < first + n; p += packet_size)
+		{
+			int m = std::min(int(packet_size), first + n - p);
+
+			if (caster == Caster::Packet)
+				CastPacket(geo, grid, &rays[p], m, 1, ids, tws, trs);
+			else
+				for (int i = 0; i < m; i++)
+					ids[i] = Cast(geo, grid, caster, rays[p + i], tws[i], trs[i],
+								  FarLimit(rays[p + i]));
+
+			for (int i = 0; i < m; i++)
+				hits[p - first + i] = ids[i] >= 0
+					? MakeHit(geo, rays[p + i], ids[i], tws[i], trs[i])
+					: RayHit{ .dist = std::numeric_limits<double>::infinity(),
+							  .wall_x = x, .wall_y = y };
+
+			if (hit_ids)
+				std::copy(ids, ids + m, hit_ids + p - first);
+		}
+	}
+
+	// One hit per ray, misses included, so the views can place every
+	// column by its index; res keeps its capacity between calls
+	void CalcRayHits(const Geometry &geo, const Grid &grid, Caster caster,
+					 std::vector<RayHit> &res) const
+	{
+		res.resize(rays.size());
+		CalcRayHits(geo, grid, caster, 0, rays.size(), res.data());
+	};
+
+	// Full 360 degree ring starting at the heading. Distances are radial,
+	// as seen on a cylinder around the player, so there is no fisheye
+	// correction. The far plane becomes a circle of the same radius, and
+	// misses are reported at infinite distance. Grid packets need the
+	// rays of a view, so they cast one by one through the grid here.
+	std::vector<RayHit> CalcPanorama(const Geometry &geo, const Grid &grid,
+									 Caster caster, int num_cols) const
+	{
+		std::vector<RayHit> res;
+		Ray ray(x, y, heading);
+
+		for (int i = 0; i < num_cols; i++)
+		{
+			double tw, tr;
+			int id = Cast(geo, grid, caster, ray, tw, tr, far_plane);
+
+			if (id >= 0)
+			{
+				RayHit hit = MakeHit(geo, ray, id, tw, tr);
+				hit.dist = tr;
+				res.push_back(hit);
+			}
+			else
+				res.push_back({ .dist = std::numeric_limits<double>::infinity(),
+								.wall_x = x, .wall_y = y });
+
+			ray.Rotate(360.0 / num_cols);
+		}
+
+		return res;
+	}
+
+	// Hits of columns [first, first + n) for both eyes, which look along
+	// the same rays shifted sideways by half of eye_dist. A grid packet
+	// walks the grid once for the columns of both eyes, the other casters
+	// go ray by ray. Misses are on the player, as in CalcRayHits.
+	void CalcStereoRayHits(const Geometry &geo, const Grid &grid, Caster caster,
+						   int first, int n, RayHit *left, RayHit *right) const
+	{
+		Vector2 side = Vector2(heading - 90.0) * (eye_dist / 2.0);
+		Ray eye_rays[2 * packet_size];
+		int ids[2 * packet_size];
+		double tws[2 * packet_size], trs[2 * packet_size];
+
+		for (int p = first; p < first + n; p += packet_size)
+		{
+			int m = std::min(int(packet_size), first + n - p);
+			for (int i = 0; i < 2 * m; i++)
+			{
+				eye_rays[i] = rays[p + i % m];
+				if (i < m)
+					eye_rays[i].MoveTo(x + side.x, y + side.y);
+				else
+					eye_rays[i].MoveTo(x - side.x, y - side.y);
+			}
+
+			if (caster == Caster::Packet)
+				CastPacket(geo, grid, eye_rays, 2 * m, 2, ids, tws, trs);
+			else
+				for (int i = 0; i < 2 * m; i++)
+					ids[i] = Cast(geo, grid, caster, eye_rays[i], tws[i], trs[i],
+								  FarLimit(eye_rays[i]));
+
+			for (int i = 0; i < m; i++)
+			{
+				double cos_a = Cos(rays[p + i].GetAngle() - heading);
+				for (int e = 0; e < 2; e++)
+				{
+					int k = e * m + i;
+					(e ? right : left)[p - first + i] = ids[k] >= 0
+						? MakeHit(geo, eye_rays[k], ids[k], tws[k], trs[k], cos_a)
+						: RayHit{ .dist = std::numeric_limits<double>::infinity(),
+								  .wall_x = x, .wall_y = y };
+				}
+			}
+		}
+	}
+};
+
+struct PathQuery
+{
+	Vector2 from, to;
+};
+
+// Per-thread A* state, reused between queries to avoid allocations
+struct NavScratch
+{
+	std::vector<double> g;
+	std::vector<int> parent;
+	std::vector<unsigned> visited;
+	std::vector<unsigned> sees_goal;	// the stamp where the node sees the goal
+	std::vector<int> near;
+	std::vector<std::pair<double, int>> open;
+	unsigned stamp = 0;
+};
+
+// Visibility graph over wall endpoints inflated by the agent radius.
+// Arcs are treated as full circles, which is conservative. Obstacles
+// and nodes are kept by cell, so a visibility test only looks at the
+// cells along the way, and every node is linked to its nearest visible
+// nodes only: paths are near optimal rather than shortest, and building
+// the graph is linear in the number of corners.
+class NavGraph
+{
+	static constexpr double radius = 4.0;
+	static constexpr double cell = 16.0;
+	static const int links = 8;	// nearest visible nodes to link to
+	static const int max_ring = 8;	// how far to look for them, in cells
+
+	std::vector<std::pair<Vector2, Vector2>> segments;
+	std::vector<Arc> arcs;
+	std::vector<Vector2> nodes;
+	std::vector<int> edge_start;
+	std::vector<int> edges;
+	std::vector<int> reachable;	// nodes of the largest connected part
+	std::vector<NavScratch> scratch;
+
+	// Segments, then arcs, and nodes by cell, laid out like Grid
+	int cols = 1, rows = 1;
+	std::vector<int> obstacle_start, obstacles;
+	std::vector<int> node_start, node_items;
+
+	int CellX(double x) const
+	{
+		return std::min(std::max(int(x / cell), 0), cols - 1);
+	}
+
+	int CellY(double y) const
+	{
+		return std::min(std::max(int(y / cell), 0), rows - 1);
+	}
+
+	// Call f(c) for the cells within pad of segment ab, row by row from
+	// a's end, until it returns false. False if it did.
+	template <typename F>
+	bool ForCells(Vector2 a, Vector2 b, double pad, F &&f) const
+	{
+		int step = b.y >= a.y ? 1 : -1;
+		int r1 = CellY(a.y - step * pad), r2 = CellY(b.y + step * pad);
+
+		for (int r = r1; r != r2 + step; r += step)
+		{
+			// Part of ab in the row and pad around it
+			double t1 = 0.0, t2 = 1.0;
+			if (b.y != a.y)
+			{
+				t1 = (r * cell - pad - a.y) / (b.y - a.y);
+				t2 = ((r + 1) * cell + pad - a.y) / (b.y - a.y);
+				if (t1 > t2)
+					std::swap(t1, t2);
+				t1 = std::max(t1, 0.0);
+				t2 = std::min(t2, 1.0);
+				if (t1 > t2)
+					continue;
+			}
+
+			double x1 = Mix(a.x, b.x, t1), x2 = Mix(a.x, b.x, t2);
+			int c1 = CellX(std::min(x1, x2) - pad), c2 = CellX(std::max(x1, x2) + pad);
+			for (int c = c1; c <= c2; c++)
+				if (!f(r * cols + c))
+					return false;
+		}
+
+		return true;
+	}
+
+	// Call f(c) for the cells of obstacle i
+	template <typename F>
+	void ForObstacleCells(int i, F &&f) const
+	{
+		auto go_on = [&](int c) { f(c); return true; };
+
+		if (i < int(segments.size()))
+			ForCells(segments[i].first, segments[i].second, 0.0, go_on);
+		else
+		{
+			const Arc &c = arcs[i - segments.size()];
+			ForCells(Vector2(c.cx, c.cy), Vector2(c.cx, c.cy), c.r, go_on);
+		}
+	}
+
+	void BuildCells()
+	{
+		int num_cells = cols * rows;
+		int n = segments.size() + arcs.size();
+
+		obstacle_start.assign(num_cells + 1, 0);
+		for (int i = 0; i < n; i++)
+			ForObstacleCells(i, [&](int c) { obstacle_start[c + 1]++; });
+		for (int c = 0; c < num_cells; c++)
+			obstacle_start[c + 1] += obstacle_start[c];
+
+		obstacles.resize(obstacle_start.back());
+		std::vector<int> fill(obstacle_start.begin(), obstacle_start.end() - 1);
+		for (int i = 0; i < n; i++)
+			ForObstacleCells(i, [&](int c) { obstacles[fill[c]++] = i; });
+	}
+
+	void BuildNodeCells()
+	{
+		int num_cells = cols * rows;
+		auto cell_of = [&](int i) { return CellY(nodes[i].y) * cols + CellX(nodes[i].x); };
+
+		node_start.assign(num_cells + 1, 0);
+		for (size_t i = 0; i < nodes.size(); i++)
+			node_start[cell_of(i) + 1]++;
+		for (int c = 0; c < num_cells; c++)
+			node_start[c + 1] += node_start[c];
+
+		node_items.resize(nodes.size());
+		std::vector<int> fill(node_start.begin(), node_start.end() - 1);
+		for (size_t i = 0; i < nodes.size(); i++)
+			node_items[fill[cell_of(i)]++] = i;
+	}
+
+	// Whether anything comes closer than radius to ab
+	bool Blocked(Vector2 a, Vector2 b) const
+	{
+		return !ForCells(a, b, radius, [&](int c)
+		{
+			for (int k = obstacle_start[c]; k < obstacle_start[c + 1]; k++)
+			{
+				int i = obstacles[k];
+				if (i < int(segments.size()))
+				{
+					if (SegmentDistance(a, b, segments[i].first, segments[i].second) < radius)
+						return false;
+				}
+				else
+				{
+					const Arc &arc = arcs[i - segments.size()];
+					if (SegmentDistance(Vector2(arc.cx, arc.cy), a, b) - arc.r < radius)
+						return false;
+				}
+			}
+			return true;
+		});
+	}
+
+	bool Visible(Vector2 a, Vector2 b) const
+	{
+		return !Blocked(a, b);
+	}
+
+	// The nodes p sees, but self, ring of cells by ring of cells around p
+	// until there are links of them or max_ring is passed
+	void NearNodes(Vector2 p, int self, std::vector<int> &res) const
+	{
+		int px = CellX(p.x), py = CellY(p.y);
+
+		res.clear();
+		for (int ring = 0; ring <= max_ring && int(res.size()) < links; ring++)
+			for (int r = std::max(py - ring, 0); r <= std::min(py + ring, rows - 1); r++)
+				for (int c = std::max(px - ring, 0); c <= std::min(px + ring, cols - 1); c++)
+				{
+					if (abs(r - py) != ring && abs(c - px) != ring)
+						continue;
+
+					int cell = r * cols + c;
+					for (int k = node_start[cell]; k < node_start[cell + 1]; k++)
+						if (node_items[k] != self && Visible(p, nodes[node_items[k]]))
+							res.push_back(node_items[k]);
+				}
+	}
+
+	void AddCorners(Vector2 p, Vector2 q)
+	{
+		Vector2 d = p - q;
+		if (d.Length() == 0.0)
+			return;
+		d.Normalize();
+		Vector2 n(-d.y, d.x);
+
+		// Corners of the endpoint's inflated square cap, the segment
+		// between them keeps clear of the endpoint itself
+		nodes.push_back(p + (d + n) * (radius * 1.05));
+		nodes.push_back(p + (d - n) * (radius * 1.05));
+	}
+
+public:
+	NavGraph() = default;
+
+	NavGraph(const Geometry &geo, int map_width, int map_height,
+			 WorkerPool &pool = Workers)
+		: arcs(geo.arcs), cols(std::max(1, int(ceil(map_width / cell)))),
+		  rows(std::max(1, int(ceil(map_height / cell))))
+	{
+		for (size_t i = 0; i < geo.walls.size(); i++)
+		{
+			const Wall &w = geo.walls[i];
+			segments.push_back(std::make_pair(Vector2(w.x1, w.y1),
+											  Vector2(w.x2, w.y2)));
+		}
+
+		for (size_t i = 0; i < geo.polys.size(); i++)
+		{
+			const std::vector<Vector2> &pts = geo.polys[i].pts;
+			for (size_t j = 0; j < pts.size(); j++)
+				segments.push_back(std::make_pair(pts[j], pts[(j + 1) % pts.size()]));
+		}
+		BuildCells();
+
+		std::vector<Vector2> corners;
+		for (size_t i = 0; i < segments.size(); i++)
+		{
+			AddCorners(segments[i].first, segments[i].second);
+			AddCorners(segments[i].second, segments[i].first);
+		}
+
+		// Corners of the inflated bounding square of every circle
+		for (size_t i = 0; i < arcs.size(); i++)
+		{
+			double h = (arcs[i].r + radius) * 1.05;
+			for (int k = 0; k < 4; k++)
+				nodes.push_back(Vector2(arcs[i].cx + (k & 1 ? h : -h),
+										arcs[i].cy + (k & 2 ? h : -h)));
+		}
+
+		corners.swap(nodes);
+		for (size_t i = 0; i < corners.size(); i++)
+			if (Visible(corners[i], corners[i]))
+				nodes.push_back(corners[i]);
+		BuildNodeCells();
+
+		std::vector<std::vector<int>> adj(nodes.size());
+		pool.Run(nodes.size(), [&](int i, int)
+		{
+			NearNodes(nodes[i], i, adj[i]);
+		});
+
+		// Both ways, a link found from either end
+		std::vector<std::pair<int, int>> pairs;
+		for (size_t i = 0; i < adj.size(); i++)
+			for (size_t k = 0; k < adj[i].size(); k++)
+			{
+				pairs.push_back(std::make_pair(i, adj[i][k]));
+				pairs.push_back(std::make_pair(adj[i][k], i));
+			}
+		std::sort(pairs.begin(), pairs.end());
+		pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+		edge_start.assign(nodes.size() + 1, 0);
+		for (size_t k = 0; k < pairs.size(); k++)
+		{
+			edge_start[pairs[k].first + 1]++;
+			edges.push_back(pairs[k].second);
+		}
+		for (size_t i = 0; i < nodes.size(); i++)
+			edge_start[i + 1] += edge_start[i];
+
+		// Connected parts, breadth first from every node not seen yet
+		std::vector<bool> seen(nodes.size(), false);
+		std::vector<int> part;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (seen[i])
+				continue;
+
+			part.assign(1, i);
+			seen[i] = true;
+			for (size_t k = 0; k < part.size(); k++)
+				for (int e = edge_start[part[k]]; e < edge_start[part[k] + 1]; e++)
+					if (!seen[edges[e]])
+					{
+						seen[edges[e]] = true;
+						part.push_back(edges[e]);
+					}
+
+			if (part.size() > reachable.size())
+				reachable.swap(part);
+		}
+
+		scratch.resize(Workers.Size());
+	}
+
+	// A node of the largest connected part, so that paths between any two
+	// of them exist; false if the graph is empty
+	bool RandomNode(Vector2 &p) const
+	{
+		if (reachable.empty())
+			return false;
+		p = nodes[reachable[rand() % reachable.size()]];
+		return true;
+	}
+
+	size_t Bytes() const
+	{
+		size_t n = VectorBytes(segments) + VectorBytes(arcs) + VectorBytes(nodes) +
+				   VectorBytes(edge_start) + VectorBytes(edges) + VectorBytes(scratch) +
+				   VectorBytes(obstacle_start) + VectorBytes(obstacles) +
+				   VectorBytes(node_start) + VectorBytes(node_items) + VectorBytes(reachable);
+		for (size_t i = 0; i < scratch.size(); i++)
+		{
+			const NavScratch &s = scratch[i];
+			n += VectorBytes(s.g) + VectorBytes(s.parent) + VectorBytes(s.visited) +
+				 VectorBytes(s.sees_goal) + VectorBytes(s.near) + VectorBytes(s.open);
+		}
+		return n;
+	}
+
+	// Thread-safe as long as every caller passes its own scratch
+	bool FindPath(const PathQuery &q, std::vector<Vector2> &path,
+				  NavScratch &s) const
+	{
+		path.clear();
+
+		if (Visible(q.from, q.to))
+		{
+			path.push_back(q.from);
+			path.push_back(q.to);
+			return true;
+		}
+
+		int n = nodes.size();
+		int start = n, goal = n + 1;
+		if (s.g.size() < size_t(n + 2))
+		{
+			s.g.resize(n + 2);
+			s.parent.resize(n + 2);
+			s.visited.assign(n + 2, 0);
+			s.sees_goal.assign(n, 0);
+		}
+		if (++s.stamp == 0)
+		{
+			std::fill(s.visited.begin(), s.visited.end(), 0);
+			std::fill(s.sees_goal.begin(), s.sees_goal.end(), 0);
+			s.stamp = 1;
+		}
+
+		// Only the nodes near the ends are tried as first and last hops
+		NearNodes(q.to, -1, s.near);
+		for (size_t k = 0; k < s.near.size(); k++)
+			s.sees_goal[s.near[k]] = s.stamp;
+
+		auto pos = [&](int i) { return i == start ? q.from : i == goal ? q.to : nodes[i]; };
+		auto cmp = [](const std::pair<double, int> &a, const std::pair<double, int> &b)
+		{
+			return a.first > b.first;
+		};
+		auto relax = [&](int from, int to)
+		{
+			double g = s.g[from] + (pos(to) - pos(from)).Length();
+			if (s.visited[to] == s.stamp && s.g[to] <= g)
+				return;
+			s.visited[to] = s.stamp;
+			s.g[to] = g;
+			s.parent[to] = from;
+			s.open.push_back(std::make_pair(g + (q.to - pos(to)).Length(), to));
+			std::push_heap(s.open.begin(), s.open.end(), cmp);
+		};
+
+		s.open.clear();
+		s.g[start] = 0.0;
+		s.visited[start] = s.stamp;
+		NearNodes(q.from, -1, s.near);
+		for (size_t k = 0; k < s.near.size(); k++)
+			relax(start, s.near[k]);
+
+		while (!s.open.empty())
+		{
+			std::pop_heap(s.open.begin(), s.open.end(), cmp);
+			std::pair<double, int> top = s.open.back();
+			s.open.pop_back();
+
+			int cur = top.second;
+			if (top.first > s.g[cur] + (q.to - pos(cur)).Length())
+				continue;	// stale heap entry
+
+			if (cur == goal)
+			{
+				for (int i = goal; i != start; i = s.parent[i])
+					path.push_back(pos(i));
+				path.push_back(q.from);
+				std::reverse(path.begin(), path.end());
+				return true;
+			}
+
+			if (s.sees_goal[cur] == s.stamp)
+				relax(cur, goal);
+			for (int e = edge_start[cur]; e < edge_start[cur + 1]; e++)
+				relax(cur, edges[e]);
+		}
+
+		return false;
+	}
+
+	// Solve a batch of queries on all workers; empty path means unreachable
+	void FindPaths(const std::vector<PathQuery> &queries,
+				   std::vector<std::vector<Vector2>> &paths)
+	{
+		paths.resize(queries.size());
+		Workers.Run(queries.size(), [&](int i, int worker)
+		{
+			FindPath(queries[i], paths[i], scratch[worker]);
+		});
+	}
+};
+
+// Heightmap and colormap for the outdoor renderer. Generated from a few
+// octaves of value noise; both maps wrap around at the edges.
+class Terrain
+{
+	static const int size = 512;	// power of two
+	std::vector<uint8_t> heights;
+	std::vector<Color> colors;
+
+	static double Noise(const std::vector<double> &lattice, int n, double x, double y)
+	{
+		int x0 = int(x), y0 = int(y);
+		double fx = x - x0, fy = y - y0;
+		auto at = [&](int i, int j) { return lattice[(j % n) * n + (i % n)]; };
+
+		return Mix(Mix(at(x0, y0), at(x0 + 1, y0), fx),
+				   Mix(at(x0, y0 + 1), at(x0 + 1, y0 + 1), fx), fy);
+	}
+
+public:
+	Terrain(): heights(size * size), colors(size * size, Color::Black())
+	{
+		std::vector<double> sum(size * size, 0.0);
+		double amplitude = 1.0;
+
+		for (int n = 4; n <= 64; n *= 2)
+		{
+			std::vector<double> lattice(n * n);
+			for (size_t i = 0; i < lattice.size(); i++)
+				lattice[i] = rand() / double(RAND_MAX);
+
+			for (int y = 0; y < size; y++)
+				for (int x = 0; x < size; x++)
+					sum[y * size + x] += amplitude *
+						Noise(lattice, n, double(x) * n / size, double(y) * n / size);
+
+			amplitude /= 2.0;
+		}
+
+		double lo = *std::min_element(sum.begin(), sum.end());
+		double hi = *std::max_element(sum.begin(), sum.end());
+		for (int i = 0; i < size * size; i++)
+			heights[i] = Map(sum[i], lo, hi, 0, 255);
+
+		for (int y = 0; y < size; y++)
+			for (int x = 0; x < size; x++)
+			{
+				int h = Height(x, y);
+				Color c = h < 70 ? Color(30, 60, 160)
+						: h < 90 ? Color(190, 170, 110)
+						: h < 170 ? Color(50, 130, 40)
+						: h < 220 ? Color(110, 100, 90)
+						: Color(235, 235, 240);
+
+				// Light from the top left
+				double k = h < 70 ? 1.0 : 1.0 + (Height(x - 1, y - 1) - h) / 16.0;
+				k = std::min(std::max(k, 0.5), 1.5);
+				colors[y * size + x] = Color(std::min(c.r * k, 255.0),
+											 std::min(c.g * k, 255.0),
+											 std::min(c.b * k, 255.0));
+			}
+	}
+
+	// Heightmap and colormap, the only textures there are
+	size_t Bytes() const
+	{
+		return VectorBytes(heights) + VectorBytes(colors);
+	}
+
+	int Height(int x, int y) const
+	{
+		return heights[(y & (size - 1)) * size + (x & (size - 1))];
+	}
+
+	const Color &ColorAt(int x, int y) const
+	{
+		return colors[(y & (size - 1)) * size + (x & (size - 1))];
+	}
+};
+
+class View
+{
+protected:
+	int x, y;
+	int width, height;
+
+public:
+	View() = default;
+
+	View(int offset, int width, int height)
+		: x(offset), width(width), height(height)
+	{
+		y = (Screen.GetHeight() - height) / 2;
+	};
+
+	// Drawing area, views never draw outside of it
+	Canvas GetCanvas() const
+	{
+		return Canvas(x, y, width, height);
+	}
+
+	void Draw() const
+	{
+		GetCanvas().Rect(x, y, width, height, Color(0, 50, 100));
+	};
+};
+
+// Minimap. Zoom 1 fits the whole map; when zoomed out so far that the
+// primitives would be sub-pixel, a cached density raster is drawn instead.
+class View2D: public View
+{
+	static constexpr double min_zoom = 1.0 / 64.0;
+	static constexpr double max_zoom = 16.0;
+	static constexpr double raster_px_per_item = 16.0;
+
+	double scale;
+	double zoom = 1.0;
+	double center_x, center_y;	// map point shown in the middle
+
+	// Density pyramid: level 0 has one texel per grid cell, every next
+	// level halves the resolution, texels hold the mean item count
+	struct Raster
+	{
+		int cols, rows;
+		std::vector<float> density;
+	};
+	std::vector<Raster> levels;
+	double cell = 1.0;
+	double map_area = 1.0;
+	size_t num_items = 0;
+
+	void DrawRaster(const Canvas &cv, double x_offset, double y_offset, double s,
+					double vx1, double vy1, double vx2, double vy2) const
+	{
+		// Coarsest texels still at least two pixels wide
+		size_t l = 0;
+		while (l + 1 < levels.size() && (cell * s * (1 << l)) < 2.0)
+			l++;
+
+		const Raster &r = levels[l];
+		double size = cell * (1 << l);
+		int c1 = std::max(int(vx1 / size), 0), c2 = std::min(int(vx2 / size), r.cols - 1);
+		int r1 = std::max(int(vy1 / size), 0), r2 = std::min(int(vy2 / size), r.rows - 1);
+
+		for (int row = r1; row <= r2; row++)
+			for (int col = c1; col <= c2; col++)
+			{
+				float d = r.density[row * r.cols + col];
+				if (d == 0.0f)
+					continue;
+
+				int px = round(col * size * s + x_offset);
+				int py = round(row * size * s + y_offset);
+				int pw = round((col + 1) * size * s + x_offset) - px;
+				int ph = round((row + 1) * size * s + y_offset) - py;
+				uint8_t w = std::min(100.0f, 25.0f + 25.0f * d);
+				cv.RectFill(px, py, std::max(pw, 1), std::max(ph, 1), Color::Gray(w));
+			}
+	}
+
+public:
+	View2D() = default;
+
+	View2D(int offset, int width, int height, double scale)
+		: View(offset, width, height), scale(scale),
+		  center_x(width / 2.0 / scale), center_y(height / 2.0 / scale)
+	{
+	};
+
+	// Rebuild the cached density raster, needed whenever the grid changes
+	void BuildRaster(const Grid &grid, int map_width, int map_height)
+	{
+		cell = grid.cell;
+		map_area = double(map_width) * map_height;
+		num_items = grid.NumItems();
+
+		levels.assign(1, Raster{ grid.cols, grid.rows, std::vector<float>() });
+		for (int c = 0; c < grid.cols * grid.rows; c++)
+			levels[0].density.push_back(grid.CellSize(c));
+
+		while (levels.back().cols > 1 || levels.back().rows > 1)
+		{
+			const Raster &f = levels.back();
+			Raster r{ (f.cols + 1) / 2, (f.rows + 1) / 2,
+					  std::vector<float>((f.cols + 1) / 2 * ((f.rows + 1) / 2)) };
+
+			for (int row = 0; row < f.rows; row++)
+				for (int col = 0; col < f.cols; col++)
+					r.density[row / 2 * r.cols + col / 2] +=
+						f.density[row * f.cols + col] / 4.0f;
+
+			levels.push_back(r);
+		}
+	}
+
+	size_t Bytes() const
+	{
+		size_t n = VectorBytes(levels);
+		for (size_t i = 0; i < levels.size(); i++)
+			n += VectorBytes(levels[i].density);
+		return n;
+	}
+
+	void Zoom(double k)
+	{
+		zoom = std::min(std::max(zoom * k, double(min_zoom)), double(max_zoom));
+	}
+
+	// Pan by a fraction of the visible area
+	void Pan(double fx, double fy)
+	{
+		center_x += fx * width / (scale * zoom);
+		center_y += fy * height / (scale * zoom);
+	}
+
+	// Geometry only; the rays depend on the 3D view's casting, so they
+	// come separately from DrawRays once the frame's hits are known
+	void Draw(const Geometry &geo, const Grid &grid, Arena &arena) const
+	{
+		double s = scale * zoom;
+		double x_offset = x + width / 2.0 - center_x * s;
+		double y_offset = y + height / 2.0 - center_y * s;
+		Canvas cv = GetCanvas();
+
+		// Visible part of the map
+		double vx1 = (x - x_offset) / s, vx2 = (x + width - x_offset) / s;
+		double vy1 = (y - y_offset) / s, vy2 = (y + height - y_offset) / s;
+
+		cv.RectFill(x, y, width, height, Color::Black());
+
+		// Expected number of primitives in view against its pixel area
+		double area = (std::min(vx2, grid.cols * cell) - std::max(vx1, 0.0)) *
+					  (std::min(vy2, grid.rows * cell) - std::max(vy1, 0.0));
+		double expected = num_items * std::max(area, 0.0) / map_area;
+
+		if (!levels.empty() && expected * raster_px_per_item > double(width) * height)
+			DrawRaster(cv, x_offset, y_offset, s, vx1, vy1, vx2, vy2);
+		else
+		{
+			FrameVector<int> visible{ ArenaAllocator<int>(arena) };
+			grid.Query(vx1, vy1, vx2, vy2, visible);
+			for (size_t i = 0; i < visible.size(); i++)
+				geo.Draw(visible[i], cv, x_offset, y_offset, s);
+		}
+	};
+
+	void DrawRays(double plr_x, double plr_y,
+				  const std::vector<RayHit> &ray_hits) const
+	{
+		double s = scale * zoom;
+		double x_offset = x + width / 2.0 - center_x * s;
+		double y_offset = y + height / 2.0 - center_y * s;
+		Canvas cv = GetCanvas();
+
+		for (size_t i = 0; i < ray_hits.size(); i++)
+		{
+			int x1 = round(plr_x * s + x_offset);
+			int y1 = round(plr_y * s + y_offset);
+			int x2 = round(ray_hits[i].wall_x * s + x_offset);
+			int y2 = round(ray_hits[i].wall_y * s + y_offset);
+			cv.Line(x1, y1, x2, y2, Color::Gray(33));
+		}
+
+		View::Draw();
+	};
+};
+
+// Distance fog that goes with the far plane: walls fade linearly into the
+// fog color, which also fills the background, and are gone at far
+struct Fog
+{
+	double far = std::numeric_limits<double>::infinity();
+	Color color = Color::Gray(40);
+
+	bool On() const
+	{
+		return far != std::numeric_limits<double>::infinity();
+	}
+
+	Color Background() const
+	{
+		return On() ? color : Color::Black();
+	}
+
+	Color Apply(const Color &c, double dist) const
+	{
+		if (!On())
+			return c;
+
+		double k = std::min(dist / far, 1.0);
+		return Color(Mix(c.r, color.r, k), Mix(c.g, color.g, k), Mix(c.b, color.b, k));
+	}
+};
+
+class View3D: public View
+{
+	static const int max_block = 64;
+	int fused_block = 16;	// columns per task of the fused view
+	Fog fog;
+
+	void DrawColumns(const Canvas &cv, const std::vector<RayHit> &ray_hits,
+					 int map_width, int x_start, int cols_width) const
+	{
+		for (size_t i = 0; i < ray_hits.size(); i++)
+		{
+			int w = cols_width / ray_hits.size();
+			int h = ColumnHeight(ray_hits[i].dist, map_width, height);
+			Color c = ColumnColor(ray_hits[i].dist, map_width, fog);
+			cv.RectFill(x_start + i * w, y + (height - h) / 2, w, h, c);
+		}
+	}
+
+public:
+	View3D() = default;
+
+	View3D(int offset, int width, int height)
+		: View(offset, width, height)
+	{
+	};
+
+	static int ColumnHeight(double dist, int map_width, int height)
+	{
+		return std::max(Map(dist, 0, map_width, height, 0), 0.0);
+	}
+
+	static Color ColumnColor(double dist, int map_width, const Fog &fog = Fog())
+	{
+		double d2 = dist * dist;
+		uint8_t b = std::max(Map(d2, 0, map_width * map_width, 100, 0), 0.0);
+		return fog.Apply(Color::Gray(b), dist);
+	}
+
+	const Fog &GetFog() const { return fog; }
+	void SetFog(const Fog &f) { fog = f; }
+
+	int GetBlock() const { return fused_block; }
+	void SetBlock(int cols) { fused_block = std::min(std::max(cols, 1), int(max_block)); }
+
+	void Draw(const std::vector<RayHit> &ray_hits, int map_width) const
+	{
+		Canvas cv = GetCanvas();
+		cv.RectFill(x, y, width, height, fog.Background());
+		DrawColumns(cv, ray_hits, map_width, x, width);
+
+		View::Draw();
+	};
+
+	// Voxel space terrain in the same column layout as the walls. Every
+	// column marches front to back with a growing step and only draws
+	// what rises above the highest point drawn so far (the y-buffer).
+	void Draw(const Terrain &terrain, double plr_x, double plr_y,
+			  Angle heading, int num_cols) const
+	{
+		static constexpr double world_scale = 4.0;	// terrain units per map unit
+		static constexpr double camera_height = 40.0;
+		static constexpr double height_scale = 240.0;
+		static constexpr double far = 800.0;
+
+		Canvas cv = GetCanvas();
+		cv.RectFill(x, y, width, height, Color(120, 170, 220));
+
+		double px = plr_x * world_scale;
+		double py = plr_y * world_scale;
+		double cam_h = terrain.Height(px, py) + camera_height;
+		double horizon = height / 3.0;
+		int w = width / num_cols;
+
+		Angle a = heading - Player::ViewAngle() / 2.0;
+		for (int i = 0; i < num_cols; i++, a += Player::ViewAngle() / num_cols)
+		{
+			Vector2 dir(a);
+			double cos_a = Cos(a - heading);
+			int y_buffer = height;
+
+			for (double z = 1.0, dz = 1.0; z < far; z += dz, dz += 0.01)
+			{
+				int tx = floor(px + dir.x * z);
+				int ty = floor(py + dir.y * z);
+				int sy = (cam_h - terrain.Height(tx, ty)) / (z * cos_a) *
+						 height_scale + horizon;
+
+				if (sy < y_buffer)
+				{
+					sy = std::max(sy, 0);
+					cv.RectFill(x + i * w, y + sy, w, y_buffer - sy,
+								terrain.ColorAt(tx, ty));
+					y_buffer = sy;
+					if (y_buffer == 0)
+						break;
+				}
+			}
+		}
+
+		View::Draw();
+	};
+
+	// Cast and shade in one go: every task takes a block of columns, casts
+	// them and fills their pixels straight into its own stripe of the
+	// framebuffer. Hit points are kept for the other views in ray_hits,
+	// which BeginFused sizes once, so it never reallocates mid-frame.
+	int BeginFused(std::vector<RayHit> &ray_hits) const
+	{
+		ray_hits.resize(Player::NumRays());
+		return (Player::NumRays() + fused_block - 1) / fused_block;
+	}
+
+	// With right, the hits of the right eye, the block is cast for both
+	// eyes of a stereo pair and drawn into the halves of the view, left
+	// eye on the left; ray_hits are then the left eye's
+	void DrawFusedBlock(int task, const Player &plr, const Geometry &geo,
+						const Grid &grid, Caster caster, int map_width,
+						std::vector<RayHit> &ray_hits, RayHit *right = nullptr) const
+	{
+		int pitch = Screen.GetWidth();
+		DrawFusedBlock(task, plr, geo, grid, caster, map_width, ray_hits.data(), right,
+					   Screen.Pixels() + y * pitch + x, pitch);
+	}
+
+	// Same into a buffer of the view's size, fb is its top left pixel
+	void DrawFusedBlock(int task, const Player &plr, const Geometry &geo,
+						const Grid &grid, Caster caster, int map_width,
+						RayHit *ray_hits, RayHit *right, uint32_t *fb, int pitch) const
+	{
+		int n = Player::NumRays();
+		int first = task * fused_block;
+		int last = std::min(n, first + fused_block);
+
+		// The block goes in packets, misses come out empty
+		if (right)
+		{
+			int half = width / 2;
+			plr.CalcStereoRayHits(geo, grid, caster, first, last - first,
+								  &ray_hits[first], &right[first]);
+			ShadeBlock(ray_hits, first, last, half / n, map_width, fb, pitch);
+			ShadeBlock(right, first, last, half / n, map_width, fb + half, pitch);
+		}
+		else
+		{
+			plr.CalcRayHits(geo, grid, caster, first, last - first, &ray_hits[first]);
+			ShadeBlock(ray_hits, first, last, width / n, map_width, fb, pitch);
+		}
+	}
+
+	// Columns [first, last) of w pixels from their hits
+	void ShadeBlock(const RayHit *ray_hits, int first, int last, int w,
+					int map_width, uint32_t *fb, int pitch) const
+	{
+		int tops[max_block], bottoms[max_block];
+		uint32_t colors[max_block];
+
+		for (int i = first; i < last; i++)
+		{
+			const RayHit &hit = ray_hits[i];
+			int h = std::min(ColumnHeight(hit.dist, map_width, height), height);
+			colors[i - first] = ColumnColor(hit.dist, map_width, fog).Pack();
+
+			tops[i - first] = (height - h) / 2;
+			bottoms[i - first] = tops[i - first] + h;
+		}
+
+		FillColumns(fb + first * w, pitch, height, last - first, w,
+					tops, bottoms, colors, fog.Background().Pack());
+	}
+
+	// n columns of w pixels side by side from fb on, column i in colors[i]
+	// from row tops[i] to bottoms[i] and background elsewhere. Row by row,
+	// so the stripe is written sequentially.
+	static void FillColumns(uint32_t *fb, int pitch, int rows, int n, int w,
+							const int *tops, const int *bottoms,
+							const uint32_t *colors, uint32_t background)
+	{
+		for (int row = 0; row < rows; row++)
+		{
+			uint32_t *p = fb + row * pitch;
+			for (int i = 0; i < n; i++)
+			{
+				uint32_t v = row >= tops[i] && row < bottoms[i] ? colors[i] : background;
+				for (int k = 0; k < w; k++)
+					*p++ = v;
+			}
+		}
+	}
+
+	int Width() const { return width; }
+	int Height() const { return height; }
+
+	// Copy rows of width pixels, as drawn by DrawFusedBlock elsewhere, to
+	// the view's rectangle of the framebuffer
+	void Composite(const uint32_t *pixels) const
+	{
+		int pitch = Screen.GetWidth();
+		uint32_t *fb = Screen.Pixels() + y * pitch + x;
+		for (int row = 0; row < height; row++)
+			memcpy(fb + row * pitch, pixels + row * width, width * sizeof(uint32_t));
+	}
+
+	// Side-by-side stereo pair, left eye on the left
+	void Draw(const std::vector<RayHit> &left, const std::vector<RayHit> &right,
+			  int map_width) const
+	{
+		Canvas cv = GetCanvas();
+		cv.RectFill(x, y, width, height, fog.Background());
+		DrawColumns(cv, left, map_width, x, width / 2);
+		DrawColumns(cv, right, map_width, x + width / 2, width / 2);
+
+		View::Draw();
+	};
+};
+
+// Cylindrical strip around the player: shaded columns like View3D, plus
+// the radial distance of every column
+class Panorama
+{
+	int width, height;
+	std::vector<Color> color;
+	std::vector<float> depth;
+
+public:
+	Panorama(const std::vector<RayHit> &ray_hits, int height, int map_width)
+		: width(ray_hits.size()), height(height),
+		  color(width * height, Color::Black())
+	{
+		for (int i = 0; i < width; i++)
+		{
+			double dist = ray_hits[i].dist;
+			int h = std::min(View3D::ColumnHeight(dist, map_width, height), height);
+			Color c = View3D::ColumnColor(dist, map_width);
+
+			for (int j = (height - h) / 2; j < (height - h) / 2 + h; j++)
+				color[j * width + i] = c;
+
+			depth.push_back(dist);
+		}
+	}
+
+	// Color goes to a binary PPM, depth to a one row PFM
+	bool Save(const char *color_path, const char *depth_path) const
+	{
+		std::ofstream c(color_path, std::ios::binary);
+		c << "P6\n" << width << " " << height << "\n255\n";
+		for (size_t i = 0; i < color.size(); i++)
+			c.put(color[i].r).put(color[i].g).put(color[i].b);
+
+		std::ofstream d(depth_path, std::ios::binary);
+		d << "Pf\n" << width << " 1\n-1.0\n";
+		d.write(reinterpret_cast<const char *>(depth.data()),
+				depth.size() * sizeof(float));
+
+		if (!c || !d)
+		{
+			std::cerr << "Error: cannot write panorama" << std::endl;
+			return false;
+		}
+		return true;
+	}
+};
+
+// Text-mode output of the 3D view for terminals with 24-bit color. Every
+// character cell shows two pixels stacked with the upper half block, and
+// only the cells changed since the previous frame are sent. While it is
+// up, std::cout writes to stderr, so status messages do not end up in the
+// frames; redirect stderr to keep them off the terminal as well.
+class TermScreen
+{
+	static bool Same(const Color &a, const Color &b)
+	{
+		return a.r == b.r && a.g == b.g && a.b == b.b;
+	}
+
+	struct Cell
+	{
+		Color top, bottom;
+
+		bool operator == (const Cell &c) const
+		{
+			return Same(top, c.top) && Same(bottom, c.bottom);
+		}
+	};
+
+	int cols = 80, rows = 24;
+	std::vector<Cell> cells, shown;
+	std::vector<bool> valid;
+	std::string out;
+	std::streambuf *cout_buf;
+
+	static void AppendColor(std::string &s, int layer, const Color &c)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "\x1b[%d;2;%d;%d;%dm", layer, c.r, c.g, c.b);
+		s += buf;
+	}
+
+public:
+	TermScreen()
+	{
+		winsize ws;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row)
+		{
+			cols = ws.ws_col;
+			rows = ws.ws_row;
+		}
+
+		Cell black = { Color::Black(), Color::Black() };
+		cells.assign(cols * rows, black);
+		shown.assign(cols * rows, black);
+		valid.assign(cols * rows, false);
+
+		std::cout.flush();
+		cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+
+		fputs("\x1b[?25l\x1b[2J", stdout);
+		fflush(stdout);
+	}
+
+	~TermScreen()
+	{
+		printf("\x1b[0m\x1b[%d;1H\x1b[?25h\n", rows);
+		fflush(stdout);
+
+		std::cout.rdbuf(cout_buf);
+	}
+
+	// Bytes written by the last Draw
+	size_t LastFrameBytes() const { return out.size(); }
+
+	void Draw(const std::vector<RayHit> &ray_hits, int map_width, const Fog &fog)
+	{
+		int px_height = rows * 2;
+		Color bg = fog.Background();
+
+		for (int i = 0; i < cols; i++)
+		{
+			Color c = bg;
+			int h = 0;
+
+			if (!ray_hits.empty())
+			{
+				const RayHit &hit = ray_hits[size_t(i) * ray_hits.size() / cols];
+				h = std::min(View3D::ColumnHeight(hit.dist, map_width, px_height), px_height);
+				c = View3D::ColumnColor(hit.dist, map_width, fog);
+			}
+
+			int y1 = (px_height - h) / 2, y2 = y1 + h;
+			for (int j = 0; j < rows; j++)
+			{
+				Cell &cell = cells[j * cols + i];
+				cell.top = 2 * j >= y1 && 2 * j < y2 ? c : bg;
+				cell.bottom = 2 * j + 1 >= y1 && 2 * j + 1 < y2 ? c : bg;
+			}
+		}
+
+		// Cursor moves and colors are only sent when they change
+		out.clear();
+		int cursor = -1;
+		Cell pen = { Color::Black(), Color::Black() };
+		bool pen_valid = false;
+
+		for (int k = 0; k < cols * rows; k++)
+		{
+			if (valid[k] && cells[k] == shown[k])
+				continue;
+
+			if (cursor != k)
+			{
+				char buf[32];
+				snprintf(buf, sizeof(buf), "\x1b[%d;%dH", k / cols + 1, k % cols + 1);
+				out += buf;
+			}
+
+			if (!pen_valid || !Same(cells[k].top, pen.top))
+				AppendColor(out, 38, cells[k].top);
+			if (!pen_valid || !Same(cells[k].bottom, pen.bottom))
+				AppendColor(out, 48, cells[k].bottom);
+			pen = cells[k];
+			pen_valid = true;
+
+			out += "\u2580";
+			shown[k] = cells[k];
+			valid[k] = true;
+			cursor = (k + 1) % cols ? k + 1 : -1;
+		}
+
+		if (!out.empty())
+		{
+			fwrite(out.data(), 1, out.size(), stdout);
+			fflush(stdout);
+		}
+	}
+};
+
+// Entity state as it goes over the wire: position in 1/16 map units,
+// heading in 1/65536 of a turn
+struct NetEntity
+{
+	int id;
+	int32_t x, y;
+	uint16_t heading;
+
+	bool operator == (const NetEntity &e) const
+	{
+		return id == e.id && x == e.x && y == e.y && heading == e.heading;
+	}
+};
+
+// Snapshots are lists of entities sorted by id. One is sent as the
+// changes against a baseline the client already has: per changed entity
+// its id, a byte of flags and the changed fields as zigzag varints, the
+// difference to the baseline for entities the client knows and absolute
+// values for new ones. Unchanged entities cost nothing.
+class SnapshotCodec
+{
+	enum { changed_x = 1, changed_y = 2, changed_heading = 4, removed = 8, added = 16 };
+
+	static void PutSigned(std::vector<uint8_t> &out, int32_t v)
+	{
+		PutVarint(out, uint32_t(v) << 1 ^ uint32_t(v >> 31));
+	}
+
+public:
+	static void PutVarint(std::vector<uint8_t> &out, uint32_t v)
+	{
+		for (; v >= 0x80; v >>= 7)
+			out.push_back(v | 0x80);
+		out.push_back(v);
+	}
+
+	static bool GetVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v)
+	{
+		v = 0;
+		for (int shift = 0; p < end && shift < 35; shift += 7)
+		{
+			uint8_t b = *p++;
+			v |= uint32_t(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	static bool GetSigned(const uint8_t *&p, const uint8_t *end, int32_t &v)
+	{
+		uint32_t u;
+		if (!GetVarint(p, end, u))
+			return false;
+		v = int32_t(u >> 1) ^ -int32_t(u & 1);
+		return true;
+	}
+
+	// Header is the tick and the baseline tick, 0 if there is none
+	static void Encode(uint32_t tick, uint32_t base_tick, const std::vector<NetEntity> &base,
+					   const std::vector<NetEntity> &cur, std::vector<uint8_t> &out)
+	{
+		out.clear();
+		PutVarint(out, tick);
+		PutVarint(out, base_tick);
+
+		size_t i = 0, j = 0;
+		while (i < base.size() || j < cur.size())
+		{
+			if (j == cur.size() || (i < base.size() && base[i].id < cur[j].id))
+			{
+				PutVarint(out, base[i++].id);
+				out.push_back(removed);
+				continue;
+			}
+
+			const NetEntity &e = cur[j++];
+			if (i == base.size() || base[i].id > e.id)
+			{
+				PutVarint(out, e.id);
+				out.push_back(added);
+				PutSigned(out, e.x);
+				PutSigned(out, e.y);
+				PutVarint(out, e.heading);
+				continue;
+			}
+
+			const NetEntity &b = base[i++];
+			int flags = (e.x != b.x ? changed_x : 0) | (e.y != b.y ? changed_y : 0) |
+						(e.heading != b.heading ? changed_heading : 0);
+			if (!flags)
+				continue;
+
+			PutVarint(out, e.id);
+			out.push_back(flags);
+			if (flags & changed_x)
+				PutSigned(out, e.x - b.x);
+			if (flags & changed_y)
+				PutSigned(out, e.y - b.y);
+			if (flags & changed_heading)
+				PutSigned(out, int16_t(e.heading - b.heading));
+		}
+	}
+
+	// Apply the changes after the header to base, false if they are broken
+	static bool Decode(const uint8_t *p, const uint8_t *end,
+					   const std::vector<NetEntity> &base, std::vector<NetEntity> &cur)
+	{
+		cur = base;
+
+		while (p < end)
+		{
+			uint32_t id;
+			if (!GetVarint(p, end, id) || p == end)
+				return false;
+			int flags = *p++;
+
+			std::vector<NetEntity>::iterator it = std::lower_bound(cur.begin(), cur.end(), int(id),
+				[](const NetEntity &e, int id) { return e.id < id; });
+			bool known = it != cur.end() && it->id == int(id);
+
+			if (flags & removed)
+			{
+				if (!known)
+					return false;
+				cur.erase(it);
+				continue;
+			}
+
+			if (flags & added)
+			{
+				NetEntity e = { int(id), 0, 0, 0 };
+				uint32_t heading;
+				if (known || !GetSigned(p, end, e.x) || !GetSigned(p, end, e.y) ||
+					!GetVarint(p, end, heading))
+					return false;
+				e.heading = heading;
+				cur.insert(it, e);
+				continue;
+			}
+
+			int32_t d;
+			if (!known)
+				return false;
+			if (flags & changed_x)
+			{
+				if (!GetSigned(p, end, d))
+					return false;
+				it->x += d;
+			}
+			if (flags & changed_y)
+			{
+				if (!GetSigned(p, end, d))
+					return false;
+				it->y += d;
+			}
+			if (flags & changed_heading)
+			{
+				if (!GetSigned(p, end, d))
+					return false;
+				it->heading += d;
+			}
+		}
+
+		return true;
+	}
+};
+
+// Headless authoritative server. Bots walk the map along nav graph paths
+// to random goals, and every bot has a client looking through its eyes.
+// Each tick a client gets the other bots it can see, in its view cone and
+// not behind a wall, as a delta against the last snapshot it acknowledged.
+// Server and clients talk UDP over the loopback interface; the clients
+// live in this process too and check every snapshot they decode against
+// what the server meant to send.
+class GameServer
+{
+	static const int history = 32;	// snapshots kept per client, for baselines
+	static constexpr double speed = 1.0;	// map units per tick
+
+	struct Bot
+	{
+		Vector2 pos;
+		double heading;	// degrees
+		std::vector<Vector2> path;
+		size_t next = 0;
+	};
+
+	struct Client
+	{
+		int bot;
+		int fd;
+		sockaddr_in addr;
+		uint32_t acked = 0;	// last tick the client has, 0 for none
+		std::vector<NetEntity> sent[history];
+		std::vector<uint8_t> packet;
+
+		// Receiving end
+		std::vector<NetEntity> received[history];
+		uint32_t received_tick[history] = {};
+
+		size_t bytes = 0, full_bytes = 0;
+		double cpu_ms = 0.0;
+	};
+
+	const Geometry &geo;
+	const Grid &grid;
+	NavGraph &nav;
+	int map_width, map_height;
+	std::vector<Bot> bots;
+	std::vector<Client> clients;
+	int fd;	// server socket
+	sockaddr_in addr;
+	std::vector<NetEntity> none;	// the empty baseline
+	size_t errors = 0;
+
+	static void Error(const char *msg)
+	{
+		std::cerr << "Error: " << msg << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	static double ThreadCpuMs()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+	}
+
+	static int OpenSocket(sockaddr_in &addr)
+	{
+		int s = socket(AF_INET, SOCK_DGRAM, 0);
+		if (s < 0)
+			Error("socket failed");
+
+		addr = sockaddr_in();
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (bind(s, (sockaddr *)&addr, len) || getsockname(s, (sockaddr *)&addr, &len))
+			Error("bind failed");
+
+		int size = 1 << 20;
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		fcntl(s, F_SETFL, O_NONBLOCK);
+		return s;
+	}
+
+	// Spawns and goals are nav nodes that reach each other, so every path
+	// query succeeds; any point in the open only if there are none
+	Vector2 RandomPoint() const
+	{
+		Vector2 p;
+		if (nav.RandomNode(p))
+			return p;
+
+		for (int k = 0; k < 100; k++)
+		{
+			p = Vector2(1 + rand() % (map_width - 2), 1 + rand() % (map_height - 2));
+			if (grid.Clearance(p.x, p.y) > 0.0)
+				break;
+		}
+		return p;
+	}
+
+	void MoveBots()
+	{
+		std::vector<PathQuery> queries;
+		std::vector<int> asking;
+		for (size_t i = 0; i < bots.size(); i++)
+			if (bots[i].next >= bots[i].path.size())
+			{
+				queries.push_back({ bots[i].pos, RandomPoint() });
+				asking.push_back(i);
+			}
+
+		if (!queries.empty())
+		{
+			std::vector<std::vector<Vector2>> paths;
+			nav.FindPaths(queries, paths);
+			for (size_t k = 0; k < asking.size(); k++)
+			{
+				bots[asking[k]].path.swap(paths[k]);
+				bots[asking[k]].next = 0;
+			}
+		}
+
+		for (size_t i = 0; i < bots.size(); i++)
+		{
+			Bot &b = bots[i];
+			double left = speed;
+			while (left > 0.0 && b.next < b.path.size())
+			{
+				Vector2 d = b.path[b.next] - b.pos;
+				double len = d.Length();
+				if (len <= left)
+				{
+					b.pos = b.path[b.next++];
+					left -= len;
+					continue;
+				}
+
+				b.heading = atan2(d.y, d.x) * 180.0 / M_PI;
+				b.pos = b.pos + d * (left / len);
+				left = 0.0;
+			}
+		}
+	}
+
+	// Bots the client's bot sees, as of this tick
+	void Snapshot(const Client &c, std::vector<NetEntity> &res) const
+	{
+		const Bot &me = bots[c.bot];
+		double cos_half = cos(Player::ViewAngle() / 2.0 * M_PI / 180.0);
+		Vector2 dir(cos(me.heading * M_PI / 180.0), sin(me.heading * M_PI / 180.0));
+
+		res.clear();
+		for (size_t i = 0; i < bots.size(); i++)
+		{
+			const Bot &b = bots[i];
+			Vector2 d = b.pos - me.pos;
+			double len = d.Length();
+			if (int(i) == c.bot || len == 0.0 || d * dir < len * cos_half ||
+				!Player::LineOfSight(geo, grid, me.pos, b.pos))
+				continue;
+
+			double turns = b.heading / 360.0;
+			res.push_back({ int(i), int32_t(lround(b.pos.x * 16.0)),
+							int32_t(lround(b.pos.y * 16.0)),
+							uint16_t(lround((turns - floor(turns)) * 65536.0)) });
+		}
+	}
+
+	// Everything the clients got: decode against their own baseline copy,
+	// check it, keep it and acknowledge the tick
+	void Receive()
+	{
+		uint8_t buf[65536];
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			Client &c = clients[i];
+			ssize_t n;
+			while ((n = recv(c.fd, buf, sizeof(buf), 0)) > 0)
+			{
+				const uint8_t *p = buf, *end = buf + n;
+				uint32_t tick, base_tick;
+				if (!SnapshotCodec::GetVarint(p, end, tick) ||
+					!SnapshotCodec::GetVarint(p, end, base_tick))
+				{
+					errors++;
+					continue;
+				}
+
+				const std::vector<NetEntity> &base = base_tick ? c.received[base_tick % history] : none;
+				std::vector<NetEntity> &cur = c.received[tick % history];
+				if ((base_tick && c.received_tick[base_tick % history] != base_tick) ||
+					!SnapshotCodec::Decode(p, end, base, cur) || !(cur == c.sent[tick % history]))
+				{
+					errors++;
+					continue;
+				}
+				c.received_tick[tick % history] = tick;
+
+				std::vector<uint8_t> ack;
+				SnapshotCodec::PutVarint(ack, i);
+				SnapshotCodec::PutVarint(ack, tick);
+				sendto(c.fd, ack.data(), ack.size(), 0, (sockaddr *)&addr, sizeof(addr));
+			}
+		}
+	}
+
+	void ReadAcks()
+	{
+		uint8_t buf[64];
+		ssize_t n;
+		while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+		{
+			const uint8_t *p = buf, *end = buf + n;
+			uint32_t id, tick;
+			if (SnapshotCodec::GetVarint(p, end, id) && SnapshotCodec::GetVarint(p, end, tick) &&
+				id < clients.size())
+				clients[id].acked = std::max(clients[id].acked, tick);
+		}
+	}
+
+public:
+	GameServer(const Geometry &geo, const Grid &grid, NavGraph &nav,
+			   int map_width, int map_height, int num_clients)
+		: geo(geo), grid(grid), nav(nav), map_width(map_width), map_height(map_height),
+		  bots(num_clients), clients(num_clients)
+	{
+		fd = OpenSocket(addr);
+
+		for (int i = 0; i < num_clients; i++)
+		{
+			bots[i].pos = RandomPoint();
+			bots[i].heading = rand() % 360;
+			clients[i].bot = i;
+			clients[i].fd = OpenSocket(clients[i].addr);
+		}
+	}
+
+	~GameServer()
+	{
+		close(fd);
+		for (size_t i = 0; i < clients.size(); i++)
+			close(clients[i].fd);
+	}
+
+	// Run the ticks as fast as possible and report the cost per client
+	int Run(int ticks)
+	{
+		double sim_ms = 0.0;
+
+		for (uint32_t tick = 1; tick <= uint32_t(ticks); tick++)
+		{
+			ReadAcks();
+
+			auto start = std::chrono::steady_clock::now();
+			MoveBots();
+			std::chrono::duration<double, std::milli> ms =
+				std::chrono::steady_clock::now() - start;
+			sim_ms += ms.count();
+
+			Workers.Run(clients.size(), [&](int i, int)
+			{
+				Client &c = clients[i];
+				double t0 = ThreadCpuMs();
+				std::vector<NetEntity> &cur = c.sent[tick % history];
+				Snapshot(c, cur);
+
+				// Too old a baseline may be overwritten already, then go in full
+				uint32_t base_tick = c.acked && tick - c.acked < history ? c.acked : 0;
+				SnapshotCodec::Encode(tick, base_tick, base_tick ? c.sent[base_tick % history] : none,
+									  cur, c.packet);
+				c.cpu_ms += ThreadCpuMs() - t0;
+
+				std::vector<uint8_t> full;
+				SnapshotCodec::Encode(tick, 0, none, cur, full);
+				c.full_bytes += full.size();
+			});
+
+			for (size_t i = 0; i < clients.size(); i++)
+			{
+				Client &c = clients[i];
+				if (sendto(fd, c.packet.data(), c.packet.size(), 0,
+						   (sockaddr *)&c.addr, sizeof(c.addr)) < 0)
+					Error("sendto failed");
+				c.bytes += c.packet.size();
+			}
+
+			Receive();
+		}
+
+		size_t bytes = 0, full_bytes = 0;
+		double cpu_ms = 0.0;
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			bytes += clients[i].bytes;
+			full_bytes += clients[i].full_bytes;
+			cpu_ms += clients[i].cpu_ms;
+		}
+
+		double per_client = double(ticks) * clients.size();
+		std::cout << "Server: " << clients.size() << " clients, " << ticks << " ticks, "
+				  << sim_ms / ticks << " ms per tick for the bots" << std::endl
+				  << "Per client and tick: " << bytes / per_client << " bytes ("
+				  << full_bytes / per_client << " without deltas), "
+				  << cpu_ms * 1e3 / per_client << " us CPU" << std::endl
+				  << "Bad snapshots: " << errors << std::endl;
+
+		return errors ? 1 : 0;
+	}
+};
+
+// Map file, one primitive per line, in map units and degrees; # starts
+// a comment:
+//   size width height
+//   wall x1 y1 x2 y2
+//   arc cx cy r [from to]
+//   poly x1 y1 x2 y2 x3 y3 ...
+// The size, if given, comes first, else the map has the default one.
+// Everything has to lie inside the map.
+struct MapFile
+{
+	static const int max_size = 32768;
+
+	int width, height;
+	std::vector<Wall> walls;
+	std::vector<Arc> arcs;
+	std::vector<Polygon> polys;
+	std::string error;	// why Load failed
+
+	bool Load(const std::string &path, int default_width, int default_height)
+	{
+		width = default_width;
+		height = default_height;
+
+		std::ifstream f(path);
+		if (!f)
+		{
+			error = "cannot open " + path;
+			return false;
+		}
+
+		std::string line;
+		bool first = true;
+		for (int n = 1; std::getline(f, line); n++)
+		{
+			std::istringstream in(line.substr(0, line.find('#')));
+			std::string kind;
+			if (!(in >> kind))
+				continue;
+
+			auto inside = [&](double x, double y)
+			{
+				return x >= 0 && y >= 0 && x < width && y < height;
+			};
+			bool ok = false;
+
+			if (kind == "size")
+				ok = first && in >> width >> height && width >= 16 && height >= 16 &&
+					 width <= max_size && height <= max_size;
+			else if (kind == "wall")
+			{
+				int x1, y1, x2, y2;
+				ok = in >> x1 >> y1 >> x2 >> y2 && inside(x1, y1) && inside(x2, y2);
+				if (ok)
+					walls.push_back(Wall(x1, y1, x2, y2));
+			}
+			else if (kind == "arc")
+			{
+				double cx, cy, r, from, to;
+				ok = in >> cx >> cy >> r && r > 0.0 && inside(cx - r, cy - r) &&
+					 inside(cx + r, cy + r);
+				if (ok && in >> from >> to)
+					arcs.push_back(Arc(cx, cy, r, from, to));
+				else if (ok)
+					arcs.push_back(Arc(cx, cy, r));
+			}
+			else if (kind == "poly")
+			{
+				std::vector<Vector2> pts;
+				double x, y;
+				ok = true;
+				while (in >> x >> y)
+				{
+					ok = ok && inside(x, y);
+					pts.push_back(Vector2(x, y));
+				}
+				ok = ok && pts.size() >= 3;
+				if (ok && !Polygon::Convex(pts))
+				{
+					error = path + ":" + std::to_string(n) + ": poly is not convex";
+					return false;
+				}
+				if (ok)
+					polys.push_back(Polygon(pts));
+			}
+
+			if (!ok)
+			{
+				error = path + ":" + std::to_string(n) + ": bad " + kind;
+				return false;
+			}
+			first = false;
+		}
+
+		return true;
+	}
+};
+
+// Tells when a file has been written or replaced. It watches the
+// directory, so editors that save to a temporary file and rename it over
+// the old one are caught too.
+class FileWatcher
+{
+	int fd;
+	std::string name;
+
+public:
+	explicit FileWatcher(const std::string &path)
+	{
+		size_t slash = path.rfind('/');
+		std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+		name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+			std::cerr << "Cannot watch " << path << ": " << strerror(errno) << std::endl;
+	}
+
+	~FileWatcher()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+
+	FileWatcher(const FileWatcher &) = delete;
+	FileWatcher &operator = (const FileWatcher &) = delete;
+
+	// Whether the file changed since the last call, never blocks
+	bool Changed()
+	{
+		alignas(inotify_event) char buf[4096];
+		bool changed = false;
+		ssize_t n;
+
+		while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+			for (char *p = buf; p < buf + n; )
+			{
+				const inotify_event *e = reinterpret_cast<const inotify_event *>(p);
+				if (e->len && name == e->name)
+					changed = true;
+				p += sizeof(inotify_event) + e->len;
+			}
+
+		return changed;
+	}
+};
+
+// A map file read again and compared with the walls in use
+struct MapReload
+{
+	MapFile map;
+	std::vector<int> removed;	// ids of the walls in use that are gone, ascending
+	std::vector<Wall> added;
+	bool solids_changed = false;	// arcs or polygons differ, all has to be rebuilt
+	bool resized = false;	// so does the map size
+};
+
+// Bytes held by the big structures, by name, checked against budgets.
+// Budgets are per name, "total" is the sum of all.
+class MemoryReport
+{
+	std::vector<std::pair<std::string, size_t>> entries;
+
+	static double MiB(size_t bytes)
+	{
+		return bytes / (1024.0 * 1024.0);
+	}
+
+public:
+	void Add(const std::string &name, size_t bytes)
+	{
+		entries.push_back(std::make_pair(name, bytes));
+	}
+
+	size_t Total() const
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+			n += entries[i].second;
+		return n;
+	}
+
+	void Print() const
+	{
+		char buf[96];
+		std::cout << "Memory:" << std::endl;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			snprintf(buf, sizeof(buf), "  %-20s %10.3f MiB", entries[i].first.c_str(),
+					 MiB(entries[i].second));
+			std::cout << buf << std::endl;
+		}
+		snprintf(buf, sizeof(buf), "  %-20s %10.3f MiB", "total", MiB(Total()));
+		std::cout << buf << std::endl;
+	}
+
+	// Warn about everything over its budget, false if anything is
+	bool Check(const std::map<std::string, size_t> &budgets) const
+	{
+		bool ok = true;
+		for (std::map<std::string, size_t>::const_iterator b = budgets.begin();
+			 b != budgets.end(); ++b)
+		{
+			size_t used = 0;
+			bool found = b->first == "total";
+			if (found)
+				used = Total();
+			for (size_t i = 0; i < entries.size(); i++)
+				if (entries[i].first == b->first)
+				{
+					used = entries[i].second;
+					found = true;
+				}
+
+			if (!found)
+				std::cerr << "Warning: no memory entry called " << b->first << std::endl;
+			else if (used > b->second)
+			{
+				std::cerr << "Warning: " << b->first << " uses " << MiB(used)
+						  << " MiB, over its budget of " << MiB(b->second) << " MiB"
+						  << std::endl;
+				ok = false;
+			}
+		}
+		return ok;
+	}
+};
+
+// Engine settings the tuner picks from
+struct EngineConfig
+{
+	Caster caster;
+	int threads;
+	int block;	// columns per task of the fused 3D view
+};
+
+std::string CpuModel()
+{
+	std::ifstream f("/proc/cpuinfo");
+	std::string line;
+
+	while (std::getline(f, line))
+		if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+			return line.substr(line.find_first_not_of(" \t", line.find(':') + 1));
+
+	return "unknown CPU";
+}
+
+// The tuning cache has one line per machine and map: the key, a tab and
+// the config. Later lines win.
+bool LoadTuning(const char *path, const std::string &key, EngineConfig &cfg)
+{
+	std::ifstream f(path);
+	std::string line;
+	bool found = false;
+
+	while (std::getline(f, line))
+	{
+		if (line.size() <= key.size() || line.compare(0, key.size(), key) ||
+			line[key.size()] != '\t')
+			continue;
+
+		int c, threads, block;
+		if (sscanf(line.c_str() + key.size() + 1, "%d %d %d", &c, &threads, &block) == 3 &&
+			c >= 0 && c < num_casters && threads > 0 && block > 0)
+		{
+			cfg = { Caster(c), threads, block };
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+void SaveTuning(const char *path, const std::string &key, const EngineConfig &cfg)
+{
+	std::ofstream f(path, std::ios::app);
+	f << key << '\t' << int(cfg.caster) << ' ' << cfg.threads << ' ' << cfg.block << '\n';
+	if (!f)
+		std::cerr << "Could not save the tuning to " << path << std::endl;
+}
+
+class Scene
+{
+	static const int default_map_width = 320;
+	static const int default_map_height = 240;
+	int map_width = default_map_width;	// map files may set another size
+	int map_height = default_map_height;
+
+	static const int num_walls = 6 + 4;
+	static const int num_arcs = 3;
+	static const int num_polys = 3;
+	static constexpr double grid_cell = 16.0;
+	static const int panorama_cols = 1440;
+	static const int panorama_height = 240;
+	Geometry geo;
+	Grid grid;
+
+	Player neo;
+	NavGraph nav;
+	Terrain terrain;
+	bool outdoor = false;
 	View2D top;
 	View3D scr;
 
 	std::vector<RayHit> ray_hits;
+	// Stereo only, ray_hits is the left eye
+	std::vector<RayHit> ray_hits_right = std::vector<RayHit>(Player::NumRays());
+	bool stereo = false;
+	bool fused = true;	// cast while drawing, see View3D::BeginFused
+	Caster caster = Caster::Packet;
+	bool dirty = true;	// the player moved since the last fused frame
+
+	// Fused 3D view split between worker processes, see StartProcs
+	struct StripeFrame
+	{
+		double x, y;
+		Angle heading;
+		double far;
+		Caster caster;
+		int block;
+		bool lod;
+		bool stereo;
+	};
+	std::unique_ptr<ProcessPool> procs;
+
+	// Map file and its reloads, see OpenMap
+	std::string map_path;
+	std::unique_ptr<FileWatcher> watcher;
+	std::future<std::unique_ptr<MapReload>> reload;
+	bool reload_again = false;
+	std::future<std::unique_ptr<NavGraph>> nav_build;	// see BuildNav
+	bool nav_again = false;
+	bool lod = true;
+
+	std::map<std::string, size_t> memory_budgets;	// bytes, see SetMemoryBudget
+
+	StripeFrame *Frame() const
+	{
+		return static_cast<StripeFrame *>(procs->Shared());
+	}
+
+	// The left eye's in stereo, the right eye's follow
+	RayHit *FrameHits() const
+	{
+		return reinterpret_cast<RayHit *>(Frame() + 1);
+	}
+
+	uint32_t *FramePixels() const
+	{
+		return reinterpret_cast<uint32_t *>(FrameHits() + 2 * Player::NumRays());
+	}
+
+	// Worker process k of n: take the coordinator's pose and settings,
+	// then cast and shade its share of the column blocks
+	void DrawStripe(int k, int n)
+	{
+		const StripeFrame &f = *Frame();
+		neo.SetPose(f.x, f.y, f.heading);
+		neo.SetFarPlane(f.far);
+		Fog fog = scr.GetFog();
+		fog.far = f.far;
+		scr.SetFog(fog);
+		scr.SetBlock(f.block);
+		if (f.lod != lod)
+		{
+			WorkerPool serial(1);
+			SetLod(f.lod, serial);
+		}
+
+		int tasks = scr.BeginFused(ray_hits);
+		for (int task = tasks * k / n; task < tasks * (k + 1) / n; task++)
+			scr.DrawFusedBlock(task, neo, geo, grid, f.caster, map_width, FrameHits(),
+							   f.stereo ? FrameHits() + Player::NumRays() : nullptr,
+							   FramePixels(), scr.Width());
+	}
+
+	bool Fused() const
+	{
+		return fused && !outdoor;
+	}
+
+	void CalcRayHits()
+	{
+		dirty = true;
+		if (Fused())
+			return;
+
+		if (stereo)
+		{
+			ray_hits.resize(Player::NumRays());
+			neo.CalcStereoRayHits(geo, grid, caster, 0, Player::NumRays(),
+								  ray_hits.data(), ray_hits_right.data());
+		}
+		else
+			neo.CalcRayHits(geo, grid, caster, ray_hits);
+	}
 
 public:
 	Scene()
 	{
 		InitViews();
-		InitWalls();
-		neo = Player(map_width / 2, map_height / 2);
-		ray_hits = neo.CalcRayHits(walls);
+		InitWalls();
+		Build();
+		nav = NavGraph(geo, map_width, map_height);
+		neo = Player(map_width / 2, map_height / 2);
+		CalcRayHits();
+	}
+
+	// Everything that comes from the primitives but the nav graph
+	void Build()
+	{
+		geo.SortWalls(4, map_width, map_height);	// the border stays first
+		geo.BinWalls();
+		grid = Grid(geo, map_width, map_height, grid_cell);
+		grid.BuildField();
+		if (lod)
+			grid.BuildProxies(geo, ColumnAngle());
+		top.BuildRaster(grid, map_width, map_height);
+	}
+
+	static void AddBorder(std::vector<Wall> &walls, int map_width, int map_height)
+	{
+		int w = map_width - 1;
+		int h = map_height - 1;
+
+		walls.push_back(Wall(0, 0, 0, h));
+		walls.push_back(Wall(0, 0, w, 0));
+		walls.push_back(Wall(w, 0, w, h));
+		walls.push_back(Wall(0, h, w, h));
+	}
+
+	// Take the map from a file instead, inside the usual border, and
+	// reload it whenever it changes, see Poll
+	bool OpenMap(const char *path)
+	{
+		MapFile map;
+		if (!map.Load(path, default_map_width, default_map_height))
+		{
+			std::cerr << map.error << std::endl;
+			return false;
+		}
+
+		geo.walls.clear();
+		AddBorder(geo.walls, map.width, map.height);
+		geo.walls.insert(geo.walls.end(), map.walls.begin(), map.walls.end());
+		geo.arcs.swap(map.arcs);
+		geo.polys.swap(map.polys);
+		Resize(map.width, map.height);
+		Build();
+		nav = NavGraph(geo, map_width, map_height);
+
+		map_path = path;
+		watcher.reset(new FileWatcher(path));
+		CalcRayHits();
+		CheckMemory();
+		return true;
+	}
+
+	// Read the map file and compare its walls with the ones in use. Runs
+	// on a thread of its own while frames go on, which only read geo.
+	std::unique_ptr<MapReload> ReadReload(const std::string &path) const
+	{
+		std::unique_ptr<MapReload> r(new MapReload);
+		if (!r->map.Load(path, default_map_width, default_map_height))
+			return r;
+
+		std::vector<Wall> walls;
+		AddBorder(walls, r->map.width, r->map.height);
+		walls.insert(walls.end(), r->map.walls.begin(), r->map.walls.end());
+		r->map.walls.swap(walls);
+
+		// Both sets sorted, the walls only one of them has are the delta
+		auto less = [](const Wall &a, const Wall &b)
+		{
+			return a.x1 != b.x1 ? a.x1 < b.x1 : a.y1 != b.y1 ? a.y1 < b.y1 :
+				   a.x2 != b.x2 ? a.x2 < b.x2 : a.y2 < b.y2;
+		};
+		auto order = [&](const std::vector<Wall> &w)
+		{
+			std::vector<int> ids(w.size());
+			for (size_t i = 0; i < ids.size(); i++)
+				ids[i] = i;
+			std::sort(ids.begin(), ids.end(), [&](int a, int b) { return less(w[a], w[b]); });
+			return ids;
+		};
+		const std::vector<Wall> &old_walls = geo.walls, &new_walls = r->map.walls;
+		std::vector<int> old_ids = order(old_walls), new_ids = order(new_walls);
+
+		size_t i = 0, j = 0;
+		while (i < old_ids.size() || j < new_ids.size())
+		{
+			if (j == new_ids.size() ||
+				(i < old_ids.size() && less(old_walls[old_ids[i]], new_walls[new_ids[j]])))
+				r->removed.push_back(old_ids[i++]);
+			else if (i == old_ids.size() || less(new_walls[new_ids[j]], old_walls[old_ids[i]]))
+				r->added.push_back(new_walls[new_ids[j++]]);
+			else
+				i++, j++;
+		}
+		std::sort(r->removed.begin(), r->removed.end());
+
+		r->resized = r->map.width != map_width || r->map.height != map_height;
+		r->solids_changed = r->map.arcs.size() != geo.arcs.size() ||
+							r->map.polys.size() != geo.polys.size();
+		for (size_t k = 0; !r->solids_changed && k < geo.arcs.size(); k++)
+		{
+			const Arc &a = geo.arcs[k], &b = r->map.arcs[k];
+			r->solids_changed = a.cx != b.cx || a.cy != b.cy || a.r != b.r ||
+								a.a1 != b.a1 || a.a2 != b.a2;
+		}
+		for (size_t k = 0; !r->solids_changed && k < geo.polys.size(); k++)
+		{
+			const std::vector<Vector2> &a = geo.polys[k].pts, &b = r->map.polys[k].pts;
+			r->solids_changed = a.size() != b.size();
+			for (size_t m = 0; !r->solids_changed && m < a.size(); m++)
+				r->solids_changed = a[m].x != b[m].x || a[m].y != b[m].y;
+		}
+
+		return r;
+	}
+
+	// Nav graph for the current map on a thread of its own, from a copy of
+	// the primitives, so a reload does not wait for it. The old graph
+	// serves until Poll swaps in the new one. A call while one is being
+	// built starts another one afterwards.
+	void BuildNav()
+	{
+		if (nav_build.valid())
+		{
+			nav_again = true;
+			return;
+		}
+
+		Geometry copy;
+		copy.walls = geo.walls;
+		copy.arcs = geo.arcs;
+		copy.polys = geo.polys;
+		int w = map_width, h = map_height;
+		nav_build = std::async(std::launch::async, [copy, w, h]()
+		{
+			// The pool belongs to the frames, this thread builds on its own
+			WorkerPool serial(1);
+			return std::unique_ptr<NavGraph>(new NavGraph(copy, w, h, serial));
+		});
+	}
+
+	// Between two frames: only the walls that changed go out of and into
+	// the geometry and the grid, unless the arcs or polygons changed too
+	void ApplyReload(MapReload &r)
+	{
+		if (!r.map.error.empty())
+		{
+			std::cerr << r.map.error << std::endl;
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		if (r.solids_changed || r.resized)
+		{
+			geo.walls.swap(r.map.walls);
+			geo.arcs.swap(r.map.arcs);
+			geo.polys.swap(r.map.polys);
+			Resize(r.map.width, r.map.height);
+			Build();
+		}
+		else
+		{
+			std::vector<int> remap;
+			std::vector<bool> dirty;
+			int first_added = geo.walls.size() - r.removed.size();
+			geo.ReplaceWalls(r.removed, r.added, remap);
+			grid.Update(geo, remap, first_added, dirty);
+			grid.BuildField();
+			if (lod)
+				grid.UpdateProxies(geo, ColumnAngle(), dirty);
+			top.BuildRaster(grid, map_width, map_height);
+		}
+		BuildNav();
+
+		// Worker processes have the old map
+		if (procs)
+			StartProcs(procs->Size());
+
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+		std::cout << "Reloaded " << map_path << ": " << r.removed.size() << " walls out, "
+				  << r.added.size() << " in"
+				  << (r.solids_changed || r.resized ? ", full rebuild" : "")
+				  << ", " << ms.count() << " ms" << std::endl;
+		CalcRayHits();
+		CheckMemory();
+	}
+
+	// Once a frame: notice changes of the map file, apply finished reloads
+	// and swap in finished nav graphs. A change during a reload starts
+	// another one afterwards.
+	void Poll()
+	{
+		if (watcher && watcher->Changed())
+			reload_again = true;
+
+		if (reload.valid() &&
+			reload.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			ApplyReload(*reload.get());
+
+		if (reload_again && !reload.valid())
+		{
+			reload_again = false;
+			reload = std::async(std::launch::async, &Scene::ReadReload, this, map_path);
+		}
+
+		if (nav_build.valid() &&
+			nav_build.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		{
+			nav = std::move(*nav_build.get());
+			if (nav_again)
+			{
+				nav_again = false;
+				BuildNav();
+			}
+		}
+	}
+
+	// New map size: the minimap scale follows, and the player goes to the
+	// middle if the map no longer has room where it stands
+	void Resize(int width, int height)
+	{
+		if (width == map_width && height == map_height)
+			return;
+
+		map_width = width;
+		map_height = height;
+		InitViews();
+		if (neo.GetX() >= map_width - 1 || neo.GetY() >= map_height - 1)
+			neo.SetPose(map_width / 2, map_height / 2, neo.GetHeading());
 	}
 
 	void InitViews()
 	{
-		// Allocate 1/3 of the screen width for 2D view, and 2/3 for 3D view
+		// Allocate 1/3 of the screen width for 2D view, and 2/3 for 3D view.
+		// The views keep the proportions of the default map, other maps are
+		// scaled to fit.
 		double w = Screen.GetWidth() / 3.0;
-		double scale = w / map_width;
-		double h = map_height * scale;
+		double h = w * default_map_height / default_map_width;
+		double scale = std::min(w / map_width, h / map_height);
 
-		top = View2D(0, w + 1, h, scale);
+		top = View2D(0, w, h, scale);
 		scr = View3D(w, w * 2, h * 2);
 	}
 
@@ -513,23 +4860,470 @@ public:
 	{
 		int w = map_width - 1;
 		int h = map_height - 1;
+		std::vector<Wall> &walls = geo.walls;
 
-		walls.push_back(Wall(0, 0, 0, h));
-		walls.push_back(Wall(0, 0, w, 0));
-		walls.push_back(Wall(w, 0, w, h));
-		walls.push_back(Wall(0, h, w, h));
-
+		AddBorder(walls, map_width, map_height);
 		for (int i = 4; i < num_walls; i++)
 			walls.push_back(Wall(rand() % w, rand() % h,
 							rand() % w, rand() % h));
+
+		// Round pillars, and every other one cut down to a half-open arc
+		for (int i = 0; i < num_arcs; i++)
+		{
+			double r = 5 + rand() % 10;
+			double cx = r + 1 + rand() % int(w - 2 * r - 1);
+			double cy = r + 1 + rand() % int(h - 2 * r - 1);
+			if (i % 2)
+			{
+				double a = rand() % 360;
+				geo.arcs.push_back(Arc(cx, cy, r, a, a + 180.0));
+			}
+			else
+				geo.arcs.push_back(Arc(cx, cy, r));
+		}
+
+		// Boxes and other furniture: regular polygons with 3 to 6 sides
+		for (int i = 0; i < num_polys; i++)
+		{
+			int sides = 3 + rand() % 4;
+			double r = 5 + rand() % 10;
+			double cx = r + 1 + rand() % int(w - 2 * r - 1);
+			double cy = r + 1 + rand() % int(h - 2 * r - 1);
+			double a0 = rand() % 360 * M_PI / 180.0;
+
+			std::vector<Vector2> pts;
+			for (int k = 0; k < sides; k++)
+			{
+				double a = a0 + 2.0 * M_PI * k / sides;
+				pts.push_back(Vector2(cx + r * cos(a), cy + r * sin(a)));
+			}
+			geo.polys.push_back(Polygon(pts));
+		}
 	};
 
-	void Draw() const
+	// Both views rasterize at the same time into their own rectangles of
+	// the framebuffer, which is then uploaded once. The fused 3D view is
+	// split into column blocks that share the workers with the minimap.
+	// Temporaries come from the frame arenas, so a frame does not malloc.
+	void Draw()
 	{
-		top.Draw(neo.GetX(), neo.GetY(), walls, ray_hits);
-		scr.Draw(ray_hits, map_width);
+		bool cast = Fused() && dirty;
+		bool remote = cast && procs;
+		int tasks_3d = !Fused() ? 1 : cast && !remote ? scr.BeginFused(ray_hits) : 0;
+
+		// The worker processes cast while this one draws the minimap
+		if (remote)
+		{
+			*Frame() = { neo.GetX(), neo.GetY(), neo.GetHeading(), neo.GetFarPlane(),
+						 caster, scr.GetBlock(), lod, stereo };
+			procs->Start();
+		}
+
+		ResetFrameArenas();
+		Workers.Run(1 + tasks_3d, [&](int task, int worker)
+		{
+			if (task == 0)
+				top.Draw(geo, grid, FrameArenas[worker]);
+			else if (Fused())
+				scr.DrawFusedBlock(task - 1, neo, geo, grid, caster, map_width, ray_hits,
+								   stereo ? ray_hits_right.data() : nullptr);
+			else if (outdoor)
+				scr.Draw(terrain, neo.GetX(), neo.GetY(), neo.GetHeading(),
+						 Player::NumRays());
+			else if (stereo)
+				scr.Draw(ray_hits, ray_hits_right, map_width);
+			else
+				scr.Draw(ray_hits, map_width);
+		});
+
+		if (remote)
+		{
+			procs->Wait();
+			ray_hits.assign(FrameHits(), FrameHits() + Player::NumRays());
+			if (stereo)
+				std::copy(FrameHits() + Player::NumRays(),
+						  FrameHits() + 2 * Player::NumRays(), ray_hits_right.begin());
+			scr.Composite(FramePixels());
+		}
+		dirty = false;
+
+		top.DrawRays(neo.GetX(), neo.GetY(), ray_hits);
+		if (Fused())
+			scr.View::Draw();
+
+		Screen.Upload(0, 0, Screen.GetWidth(), Screen.GetHeight());
 	};
 
+	void Draw(TermScreen &term) const
+	{
+		term.Draw(ray_hits, map_width, scr.GetFog());
+	}
+
+	void ToggleOutdoor()
+	{
+		outdoor = !outdoor;
+		CalcRayHits();
+	}
+
+	void ToggleFused()
+	{
+		fused = !fused;
+		CalcRayHits();
+	}
+
+	// Angle of one 3D view column, in radians
+	static double ColumnAngle()
+	{
+		return Player::ViewAngle() / Player::NumRays() * M_PI / 180.0;
+	}
+
+	MemoryReport Memory() const
+	{
+		MemoryReport r;
+		r.Add("walls", geo.Bytes());
+		r.Add("grid", grid.Bytes());
+		r.Add("distance field", grid.FieldBytes());
+		r.Add("wall proxies", grid.ProxyBytes());
+		r.Add("nav graph", nav.Bytes());
+		r.Add("minimap raster", top.Bytes());
+		r.Add("terrain", terrain.Bytes());
+		r.Add("ray hits", VectorBytes(ray_hits) + VectorBytes(ray_hits_right));
+
+		size_t arenas = VectorBytes(FrameArenas);
+		for (size_t i = 0; i < FrameArenas.size(); i++)
+			arenas += FrameArenas[i].Bytes();
+		r.Add("frame arenas", arenas);
+
+		r.Add("framebuffer", Screen.Bytes());
+		if (procs)
+			r.Add("worker processes", procs->SharedBytes());
+		return r;
+	}
+
+	// Warn whenever the entry of the memory report called name, or the
+	// total, grows past bytes
+	void SetMemoryBudget(const std::string &name, size_t bytes)
+	{
+		memory_budgets[name] = bytes;
+	}
+
+	bool CheckMemory() const
+	{
+		return Memory().Check(memory_budgets);
+	}
+
+	void ReportMemory() const
+	{
+		MemoryReport r = Memory();
+		r.Print();
+		r.Check(memory_budgets);
+	}
+
+	// Wall proxies on or off. Worker processes follow with the next frame,
+	// see DrawStripe.
+	void SetLod(bool on, WorkerPool &pool = Workers)
+	{
+		lod = on;
+		if (lod)
+			grid.BuildProxies(geo, ColumnAngle(), pool);
+		else
+			grid.ClearProxies();
+	}
+
+	void ToggleLod()
+	{
+		SetLod(!lod);
+
+		std::cout << "Distant wall proxies " << (grid.HasProxies() ? "on" : "off")
+				  << std::endl;
+		CalcRayHits();
+	}
+
+	// View distance, infinite turns the far plane and the fog off
+	void SetFarPlane(double far)
+	{
+		Fog fog = scr.GetFog();
+		fog.far = far;
+		scr.SetFog(fog);
+		neo.SetFarPlane(far);
+
+		if (fog.On())
+			std::cout << "Far plane at " << far << std::endl;
+		else
+			std::cout << "Far plane off" << std::endl;
+		CalcRayHits();
+	}
+
+	// Halve or double the view distance, between a cell and the map size
+	void ScaleFarPlane(double k)
+	{
+		double far = neo.GetFarPlane();
+
+		if (far == std::numeric_limits<double>::infinity())
+			far = k < 1.0 ? map_width : far;
+		else if (far * k > map_width)
+			far = std::numeric_limits<double>::infinity();
+		else
+			far = std::max(far * k, double(grid_cell));
+
+		SetFarPlane(far);
+	}
+
+	void NextCaster()
+	{
+		caster = Caster((int(caster) + 1) % num_casters);
+		std::cout << "Caster: " << CasterName(caster) << std::endl;
+		CalcRayHits();
+	}
+
+	// Cast the fused 3D view in n worker processes, each taking a stripe
+	// of column blocks. They are forked from the finished scene, so they
+	// have the map already, and every frame only the pose goes out and
+	// the pixels and hits come back through shared memory.
+	void StartProcs(int n)
+	{
+		size_t bytes = sizeof(StripeFrame) + 2 * Player::NumRays() * sizeof(RayHit) +
+					   size_t(scr.Width()) * scr.Height() * sizeof(uint32_t);
+
+		procs.reset(new ProcessPool(bytes));
+		procs->Fork(n, [this](int k, int n)
+		{
+			DrawStripe(k, n);
+		});
+		CalcRayHits();
+	}
+
+	void Apply(const EngineConfig &cfg)
+	{
+		caster = cfg.caster;
+		Workers.SetActive(cfg.threads);
+		scr.SetBlock(cfg.block);
+		CalcRayHits();
+	}
+
+	// Time of one fused 3D frame with the config in ms, the best of a few
+	// runs. A run looks around in a full circle, so that every part of
+	// the map counts and not just what is in front of the player.
+	double TimeConfig(const EngineConfig &cfg)
+	{
+		static const int headings = 8;
+		static const int runs = 3;
+		std::vector<Player> views(headings, neo);
+		for (int i = 0; i < headings; i++)
+			views[i].Rotate(360.0 / headings * i);
+
+		Apply(cfg);
+		double best = std::numeric_limits<double>::max();
+		for (int run = 0; run < runs; run++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < headings; i++)
+				Workers.Run(scr.BeginFused(ray_hits), [&](int task, int)
+				{
+					scr.DrawFusedBlock(task, views[i], geo, grid, caster, map_width,
+									   ray_hits);
+				});
+			std::chrono::duration<double, std::milli> ms =
+				std::chrono::steady_clock::now() - start;
+			best = std::min(best, ms.count() / headings);
+		}
+
+		return best;
+	}
+
+	// Try every caster with 1, 2, 4, ... threads and a few block sizes on
+	// this map and keep the fastest. The choice is cached in path under
+	// the CPU model, the thread count and the map hash, so the next start
+	// on the same kind of machine only reads it; delete the file to
+	// measure again.
+	void Tune(const char *path)
+	{
+		static const int blocks[] = { 8, 16, 32, 64 };
+		char hash[32];
+		snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)geo.Hash());
+		std::string key = CpuModel() + ", " + std::to_string(Workers.Size()) +
+						  " threads, map " + hash;
+
+		EngineConfig best;
+		if (LoadTuning(path, key, best))
+		{
+			std::cout << "Tuning from " << path << ": " << CasterName(best.caster)
+					  << ", " << best.threads << " thread(s), " << best.block
+					  << " columns per task" << std::endl;
+			Apply(best);
+			return;
+		}
+
+		double best_ms = std::numeric_limits<double>::max();
+		for (int c = 0; c < num_casters; c++)
+			for (int threads = 1;; threads = std::min(threads * 2, Workers.Size()))
+			{
+				for (int block : blocks)
+				{
+					EngineConfig cfg = { Caster(c), threads, block };
+					double ms = TimeConfig(cfg);
+					if (ms < best_ms)
+					{
+						best_ms = ms;
+						best = cfg;
+					}
+				}
+
+				if (threads == Workers.Size())
+					break;
+			}
+
+		std::cout << "Tuned: " << CasterName(best.caster) << ", " << best.threads
+				  << " thread(s), " << best.block << " columns per task, "
+				  << best_ms << " ms per frame" << std::endl;
+		SaveTuning(path, key, best);
+		Apply(best);
+	}
+
+	// Column by column comparison of the casters with the brute force
+	// one on random poses. The first pass has no far plane and no wall
+	// proxies, so every column should match the reference exactly; the
+	// second one uses the far plane and proxies as configured, and the
+	// columns that hit a proxy are counted apart, as they are approximate
+	// by design. Ids differing at the same depth are ties, where two
+	// primitives meet. Returns 1 if the exact pass has depth mismatches.
+	int Validate(int poses)
+	{
+		static const double tolerance = 1e-9;
+		static const int max_shown = 8;	// per caster and pass
+		int n = Player::NumRays();
+		double far = neo.GetFarPlane();
+		std::vector<RayHit> ref_hits(n), hits(n);
+		std::vector<int> ref_ids(n), ids(n);
+		int failed = 0;
+
+		auto same = [](double a, double b)
+		{
+			return a == b || fabs(a - b) <= tolerance * std::max(1.0, fabs(b));
+		};
+
+		std::srand(1);
+		std::vector<Player> views(poses, neo);
+		for (Player &view : views)
+		{
+			Angle heading = Angle();
+			heading += rand() % 3600 / 10.0;
+			view.SetPose(1.0 + rand() / double(RAND_MAX) * (map_width - 2),
+						 1.0 + rand() / double(RAND_MAX) * (map_height - 2), heading);
+		}
+
+		for (int pass = 0; pass < 2; pass++)
+		{
+			bool exact = pass == 0;
+			if (exact || !lod)
+				grid.ClearProxies();
+			else
+				grid.BuildProxies(geo, ColumnAngle());
+
+			std::cout << (exact ? "Exact" : "As configured") << ", far plane "
+					  << (exact ? std::numeric_limits<double>::infinity() : far)
+					  << ", wall proxies " << (grid.HasProxies() ? "on" : "off")
+					  << ", " << poses << " poses of " << n << " columns" << std::endl;
+
+			for (int c = 1; c < num_casters; c++)
+			{
+				int depth_errors = 0, id_errors = 0, ties = 0, on_proxies = 0, shown = 0;
+				double max_error = 0.0, max_proxy_error = 0.0;
+
+				for (int k = 0; k < poses; k++)
+				{
+					Player &view = views[k];
+					view.SetFarPlane(exact ? std::numeric_limits<double>::infinity() : far);
+					view.CalcRayHits(geo, grid, Caster::Brute, 0, n, &ref_hits[0], &ref_ids[0]);
+					view.CalcRayHits(geo, grid, Caster(c), 0, n, &hits[0], &ids[0]);
+
+					for (int i = 0; i < n; i++)
+					{
+						double a = hits[i].dist, b = ref_hits[i].dist;
+						double error = a == b ? 0.0 : fabs(a - b);
+
+						if (ids[i] >= geo.Count())
+						{
+							on_proxies++;
+							max_proxy_error = std::max(max_proxy_error, error);
+							continue;
+						}
+
+						bool depth_ok = same(a, b);
+						if (depth_ok && ids[i] == ref_ids[i])
+							continue;
+
+						if (!depth_ok)
+						{
+							depth_errors++;
+							max_error = std::max(max_error, error);
+						}
+						if (ids[i] != ref_ids[i])
+						{
+							id_errors++;
+							ties += depth_ok;
+						}
+
+						if (!depth_ok && shown++ < max_shown)
+							std::cout << "  " << CasterName(Caster(c)) << ": pose " << k
+									  << " (" << view.GetX() << ", " << view.GetY()
+									  << "), column " << i << ": depth " << a << " id "
+									  << ids[i] << ", reference depth " << b << " id "
+									  << ref_ids[i] << std::endl;
+					}
+				}
+
+				std::cout << "  " << CasterName(Caster(c)) << ": " << depth_errors
+						  << " depth mismatches (max error " << max_error << "), "
+						  << id_errors << " wall id mismatches (" << ties << " of them ties)";
+				if (on_proxies)
+					std::cout << ", " << on_proxies << " columns on proxies (max error "
+							  << max_proxy_error << ")";
+				std::cout << std::endl;
+
+				if (exact && depth_errors)
+					failed = 1;
+			}
+		}
+
+		if (lod)
+			grid.BuildProxies(geo, ColumnAngle());
+		else
+			grid.ClearProxies();
+		return failed;
+	}
+
+	void CapturePanorama() const
+	{
+		Panorama pano(neo.CalcPanorama(geo, grid, caster, panorama_cols),
+					  panorama_height, map_width);
+		if (pano.Save("panorama.ppm", "panorama.pfm"))
+			std::cout << "Saved panorama.ppm and panorama.pfm" << std::endl;
+	}
+
+	void ToggleStereo()
+	{
+		stereo = !stereo;
+		CalcRayHits();
+	}
+
+	void ZoomMinimap(double k)
+	{
+		top.Zoom(k);
+	}
+
+	void PanMinimap(double fx, double fy)
+	{
+		top.Pan(fx, fy);
+	}
+
+	// Headless server on this map, see GameServer
+	int Serve(int clients, int ticks)
+	{
+		GameServer server(geo, grid, nav, map_width, map_height, clients);
+		return server.Run(ticks);
+	}
+
 	void Move(double da, double dd)
 	{
 		if (da)
@@ -539,7 +5333,7 @@ public:
 			neo.Move(dd);
 
 		if (da || dd)
-			ray_hits = neo.CalcRayHits(walls);
+			CalcRayHits();
 	}
 };
 
@@ -585,11 +5379,368 @@ void KeyUp(SDL_Keycode key, double &da, double &dd)
 	}
 }
 
-int main()
+void SceneKey(SDL_Keycode key, Scene &scene)
+{
+	switch (key)
+	{
+		case SDLK_v:
+			scene.ToggleStereo();
+			break;
+		case SDLK_p:
+			scene.CapturePanorama();
+			break;
+		case SDLK_t:
+			scene.ToggleOutdoor();
+			break;
+		case SDLK_f:
+			scene.ToggleFused();
+			break;
+		case SDLK_c:
+			scene.NextCaster();
+			break;
+		case SDLK_l:
+			scene.ToggleLod();
+			break;
+		case SDLK_m:
+			scene.ReportMemory();
+			break;
+		case SDLK_PAGEDOWN:
+			scene.ScaleFarPlane(0.5);
+			break;
+		case SDLK_PAGEUP:
+			scene.ScaleFarPlane(2.0);
+			break;
+		case SDLK_EQUALS:
+			scene.ZoomMinimap(1.25);
+			break;
+		case SDLK_MINUS:
+			scene.ZoomMinimap(0.8);
+			break;
+		case SDLK_w:
+			scene.PanMinimap(0.0, -0.125);
+			break;
+		case SDLK_s:
+			scene.PanMinimap(0.0, 0.125);
+			break;
+		case SDLK_a:
+			scene.PanMinimap(-0.125, 0.0);
+			break;
+		case SDLK_d:
+			scene.PanMinimap(0.125, 0.0);
+			break;
+	}
+}
+
+#ifdef KERNEL_BENCH
+// Time of the grid build on a map of short random walls, about one per
+// cell of the scene's grid, on one thread and on the whole pool
+int BenchGrid(int num_walls)
+{
+	static constexpr double cell = 16.0;
+	int side = ceil(sqrt(double(num_walls)) * cell);
+	Geometry geo;
+
+	for (int i = 0; i < num_walls; i++)
+	{
+		int x = rand() % side, y = rand() % side;
+		geo.walls.push_back(Wall(x, y, std::min(std::max(x + rand() % 33 - 16, 0), side - 1),
+								 std::min(std::max(y + rand() % 33 - 16, 0), side - 1)));
+	}
+
+	WorkerPool serial(1);
+	WorkerPool *pools[2] = { &serial, &Workers };
+
+	for (int k = 0; k < 2; k++)
+	{
+		double best = std::numeric_limits<double>::max();
+		for (int run = 0; run < 3; run++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			Grid grid(geo, side, side, cell, *pools[k]);
+			std::chrono::duration<double, std::milli> ms =
+				std::chrono::steady_clock::now() - start;
+			best = std::min(best, ms.count());
+		}
+
+		std::cout << "Grid build, " << pools[k]->Size() << " thread(s): "
+				  << best << " ms for " << num_walls << " walls, "
+				  << best * 1e6 / num_walls << " ms per million walls" << std::endl;
+	}
+
+	return 0;
+}
+
+// Keeps benchmarked results alive
+static volatile double BenchSink;
+
+// Nanoseconds per op of f(), which does ops ops: the best of five runs,
+// each repeating f for at least 20 ms
+template <typename F>
+double TimeKernel(size_t ops, F &&f)
+{
+	double best = std::numeric_limits<double>::max();
+
+	for (int run = 0; run < 5; run++)
+	{
+		size_t reps = 0;
+		auto start = std::chrono::steady_clock::now();
+		std::chrono::duration<double, std::nano> ns(0.0);
+		while (ns.count() < 20e6)
+		{
+			f();
+			reps++;
+			ns = std::chrono::steady_clock::now() - start;
+		}
+		best = std::min(best, ns.count() / (double(reps) * ops));
+	}
+
+	return best;
+}
+
+// One line of the kernel report; bytes per op, if given, adds bandwidth
+void ReportKernel(const char *name, size_t size, double ns, double bytes = 0.0)
+{
+	char buf[128];
+	int n = snprintf(buf, sizeof(buf), "%-28s n=%-8zu %9.3f ns/op %10.2f Mop/s",
+					 name, size, ns, 1e3 / ns);
+	if (bytes > 0.0)
+		snprintf(buf + n, sizeof(buf) - n, " %8.2f GB/s", bytes / ns);
+	std::cout << buf << std::endl;
+}
+
+// The hot primitives one by one, on inputs of a few sizes: from fitting
+// in L1 to well past the caches for the intersections, and one column
+// to the whole 3D view for the fills
+int BenchKernels()
+{
+	// Off the axes, or it would never hit a horizontal wall
+	Player plr(160.0, 120.0);
+	plr.Rotate(-30.0);
+	Ray ray(160.0, 120.0, plr.GetHeading());
+	const Vector2 &dir = ray.GetDir();
+	double tw, tr;
+
+	for (size_t n : { size_t(64), size_t(4096), size_t(262144) })
+	{
+		std::vector<Wall> walls;
+		std::vector<AxisWall> h_walls;
+		for (size_t i = 0; i < n; i++)
+		{
+			int x = rand() % 320, y = rand() % 240;
+			walls.push_back(Wall(x, y, rand() % 320, rand() % 240));
+
+			// Ahead of the ray, every other one across it, so that hits and
+			// misses are timed alike
+			double hy = rand() % 120, hx = 160.0 + (hy - 120.0) * dir.x / dir.y;
+			double lo = i % 2 ? hx - rand() % 16 - 1 : hx + rand() % 16 + 1;
+			h_walls.push_back({ hy, lo, lo + 16.0, int(i), WallKind::Horizontal });
+		}
+
+		ReportKernel("Ray::Intersect(Wall)", n, TimeKernel(n, [&]
+		{
+			double sum = 0.0;
+			for (size_t i = 0; i < n; i++)
+				if (ray.Intersect(walls[i], tw, tr))
+					sum += tr;
+			BenchSink = sum;
+		}));
+
+		ReportKernel("Ray::IntersectH", n, TimeKernel(n, [&]
+		{
+			double sum = 0.0;
+			for (size_t i = 0; i < n; i++)
+				if (ray.IntersectH(h_walls[i].at, h_walls[i].lo, h_walls[i].hi, tr))
+					sum += tr;
+			BenchSink = sum;
+		}));
+	}
+
+	std::vector<Arc> arcs;
+	std::vector<Polygon> polys;
+	for (int i = 0; i < 64; i++)
+	{
+		double cx = 20 + rand() % 280, cy = 20 + rand() % 200;
+		arcs.push_back(Arc(cx, cy, 5 + rand() % 10));
+
+		std::vector<Vector2> pts;
+		for (int k = 0; k < 6; k++)
+			pts.push_back(Vector2(cx + 8 * cos(k * M_PI / 3), cy + 8 * sin(k * M_PI / 3)));
+		polys.push_back(Polygon(pts));
+	}
+
+	ReportKernel("Ray::Intersect(Arc)", arcs.size(), TimeKernel(arcs.size(), [&]
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < arcs.size(); i++)
+			if (ray.Intersect(arcs[i], tw, tr))
+				sum += tr;
+		BenchSink = sum;
+	}));
+
+	ReportKernel("Ray::Intersect(Polygon)", polys.size(), TimeKernel(polys.size(), [&]
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < polys.size(); i++)
+			if (ray.Intersect(polys[i], tr))
+				sum += tr;
+		BenchSink = sum;
+	}));
+
+	// Scalar math, over a buffer of inputs so the calls are not folded
+	static const size_t num_inputs = 4096;
+	std::vector<double> in(num_inputs);
+	for (size_t i = 0; i < num_inputs; i++)
+		in[i] = rand() / double(RAND_MAX);
+
+	ReportKernel("Vector2(Angle)", num_inputs, TimeKernel(num_inputs, [&]
+	{
+		double sum = 0.0;
+		Angle a = Angle();
+		for (size_t i = 0; i < num_inputs; i++)
+		{
+			a += in[i];
+			Vector2 v(a);
+			sum += v.x + v.y;
+		}
+		BenchSink = sum;
+	}));
+
+	ReportKernel("Mix", num_inputs, TimeKernel(num_inputs, [&]
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < num_inputs; i++)
+			sum += Mix(1.0, 5.0, in[i]);
+		BenchSink = sum;
+	}));
+
+	ReportKernel("Map", num_inputs, TimeKernel(num_inputs, [&]
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < num_inputs; i++)
+			sum += Map(in[i], 0.0, 1.0, 100.0, 0.0);
+		BenchSink = sum;
+	}));
+
+	ReportKernel("Color::Gray", num_inputs, TimeKernel(num_inputs, [&]
+	{
+		unsigned sum = 0;
+		for (size_t i = 0; i < num_inputs; i++)
+			sum += Color::Gray(in[i] * 100).Pack();
+		BenchSink = sum;
+	}));
+
+	// Fill and upload straight into the 3D view's part of the screen
+	int pitch = Screen.GetWidth();
+	int view_w = Screen.GetWidth() * 2 / 3, view_h = Screen.GetHeight();
+	int w = view_w / Player::NumRays();
+	std::vector<int> tops(Player::NumRays()), bottoms(Player::NumRays());
+	std::vector<uint32_t> colors(Player::NumRays());
+	for (int i = 0; i < Player::NumRays(); i++)
+	{
+		tops[i] = rand() % (view_h / 2);
+		bottoms[i] = view_h - tops[i];
+		colors[i] = Color::Gray(rand() % 100).Pack();
+	}
+
+	for (int cols : { 1, 16, Player::NumRays() })
+	{
+		size_t pixels = size_t(cols) * w * view_h;
+		ReportKernel("View3D::FillColumns", pixels, TimeKernel(pixels, [&]
+		{
+			View3D::FillColumns(Screen.Pixels(), pitch, view_h, cols, w, tops.data(),
+								bottoms.data(), colors.data(), Color::Black().Pack());
+		}), sizeof(uint32_t));
+	}
+
+	for (int rows : { 1, 64, view_h })
+	{
+		size_t pixels = size_t(view_w) * rows;
+		ReportKernel("SDL_Screen::Upload", pixels, TimeKernel(pixels, [&]
+		{
+			Screen.Upload(0, 0, view_w, rows);
+		}), sizeof(uint32_t));
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 3 && !strcmp(argv[1], "--grid") && atoi(argv[2]) > 0)
+		return BenchGrid(atoi(argv[2]));
+	if (argc != 1)
+	{
+		std::cerr << "Usage: " << argv[0] << " [--grid <walls>]" << std::endl;
+		return 1;
+	}
+
+	return BenchKernels();
+}
+#else
+int main(int argc, char *argv[])
 {
 	Scene Scene;
 	double da = 0.0, dd = 0.0;
 	bool stop = false;
+	bool use_term = false;
+	bool tune = false;
+	int procs = 0;
+	int clients = 0, ticks = 600;
+	int validate = 0;
+	const char *map = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--term"))
+			use_term = true;
+		else if (!strcmp(argv[i], "--far") && i + 1 < argc && atof(argv[i + 1]) > 0.0)
+			Scene.SetFarPlane(atof(argv[++i]));
+		else if (!strcmp(argv[i], "--map") && i + 1 < argc)
+			map = argv[++i];
+		else if (!strcmp(argv[i], "--mem-budget") && i + 1 < argc &&
+				 strchr(argv[i + 1], '=') && atof(strchr(argv[i + 1], '=') + 1) > 0.0)
+		{
+			const char *eq = strchr(argv[++i], '=');
+			Scene.SetMemoryBudget(std::string(argv[i], eq - argv[i]), atof(eq + 1) * 1024 * 1024);
+		}
+		else if (!strcmp(argv[i], "--tune"))
+			tune = true;
+		else if (!strcmp(argv[i], "--procs") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			procs = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--server") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			clients = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--ticks") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			ticks = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--validate") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			validate = atoi(argv[++i]);
+		else
+		{
+			std::cerr << "Usage: " << argv[0]
+					  << " [--term] [--map <file>] [--mem-budget <name>=<MiB>] [--far <dist>]"
+					  << " [--tune] [--procs <n>]"
+					  << " [--server <clients> [--ticks <n>]] [--validate <poses>]"
+					  << std::endl;
+			return 1;
+		}
+	}
+
+	if (map && !Scene.OpenMap(map))
+		return 1;
+
+	if (clients)
+		return Scene.Serve(clients, ticks);
+
+	if (validate)
+		return Scene.Validate(validate);
+
+	// Restores the terminal on every way out
+	std::unique_ptr<TermScreen> term(use_term ? new TermScreen : nullptr);
+
+	if (tune)
+		Scene.Tune("raycast.tune");
+	if (procs)
+		Scene.StartProcs(procs);
+	Scene.CheckMemory();
 
 	std::srand(std::time(nullptr));
 
@@ -602,6 +5753,7 @@ int main()
 			{
 				case SDL_KEYDOWN:
 					KeyDown(event.key.keysym.sym, da, dd);
+					SceneKey(event.key.keysym.sym, Scene);
 					break;
 				case SDL_KEYUP:
 					KeyUp(event.key.keysym.sym, da, dd);
@@ -612,12 +5764,19 @@ int main()
 			}
 		}
 
+		Scene.Poll();
 		Scene.Move(da, dd);
 		Screen.Clear();
 		Scene.Draw();
 		Screen.Update();
+		if (term)
+			Scene.Draw(*term);
 		SDL_Delay(10);
 	}
 
+	term.reset();	// the report goes to stdout again
+	Scene.ReportMemory();
+	ReportFrameArenas();
 	return 0;
 }
+#endif